@@ -10,11 +10,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 #include "tiny.h"
 
@@ -22,6 +25,24 @@
 int simulation = 0;
 static cmd_ptr cmd_list = NULL;
 static param_ptr param_list = NULL;
+
+/*
+ * Commands and parameters are also indexed by name in open addressing
+ * tables, so that dispatch does not walk the lists.  The sorted lists
+ * remain for help and completion.
+ */
+typedef struct {
+    const char *name;
+    void *ele;
+} name_slot_t;
+
+typedef struct {
+    name_slot_t *slots; /* Size is a power of two, zero until first insert */
+    size_t size;
+    size_t count;
+} name_table_t;
+
+static name_table_t cmd_table, param_table;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -36,6 +57,7 @@ static double last_time;
 /*
  * Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are mapped instead, and their lines handed out in place.
  */
 
 #define RIO_BUFSIZE 8192
@@ -46,6 +68,11 @@ struct RIO_ELE {
     int cnt;               /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *map;             /* Mapped file contents, or NULL to use buf */
+    size_t map_size;       /* Bytes mapped */
+    size_t map_pos;        /* Offset of next unread line in map */
+    char *tail;            /* Copy of a last line lacking a newline */
+    size_t tail_size;
     rio_ptr prev;          /* Next element in stack */
 };
 
@@ -71,6 +98,9 @@ static bool has_infile = false;
 static cmd_function quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Maximum number of words on a command line */
+#define MAXARGS 64
+
 static void init_in();
 
 static bool push_file(char *fname);
@@ -78,6 +108,65 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of a name */
+static size_t name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Slot holding name, or the empty slot where it belongs */
+static name_slot_t *table_slot(const name_table_t *t, const char *name)
+{
+    size_t mask = t->size - 1;
+    for (size_t i = name_hash(name) & mask;; i = (i + 1) & mask) {
+        name_slot_t *slot = &t->slots[i];
+        if (!slot->name || strcmp(slot->name, name) == 0)
+            return slot;
+    }
+}
+
+static void *table_find(const name_table_t *t, const char *name)
+{
+    return t->size ? table_slot(t, name)->ele : NULL;
+}
+
+static void table_clear(name_table_t *t)
+{
+    if (t->size)
+        free_array(t->slots, t->size, sizeof(name_slot_t));
+    t->slots = NULL;
+    t->size = 0;
+    t->count = 0;
+}
+
+/* Map name to ele, replacing any earlier element of that name */
+static void table_insert(name_table_t *t, const char *name, void *ele)
+{
+    /* Keep at least half of the slots empty, so probes stay short */
+    if (2 * (t->count + 1) > t->size) {
+        name_table_t old = *t;
+        t->size = old.size ? 2 * old.size : 16;
+        t->slots = calloc_or_fail(t->size, sizeof(name_slot_t), "table_insert");
+        for (size_t i = 0; i < old.size; i++) {
+            if (old.slots[i].name)
+                *table_slot(t, old.slots[i].name) = old.slots[i];
+        }
+        if (old.size)
+            free_array(old.slots, old.size, sizeof(name_slot_t));
+    }
+
+    name_slot_t *slot = table_slot(t, name);
+    if (!slot->name)
+        t->count++;
+    slot->name = name;
+    slot->ele = ele;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_function operation, char *documentation)
 {
@@ -92,8 +181,10 @@ void add_cmd(char *name, cmd_function operation, char *documentation)
     ele->name = name;
     ele->operation = operation;
     ele->documentation = documentation;
+    ele->latency = NULL;
     ele->next = next_cmd;
     *last_loc = ele;
+    table_insert(&cmd_table, name, ele);
 }
 
 /* Add a new parameter */
@@ -116,52 +207,109 @@ void add_param(char *name,
     ele->setter = setter;
     ele->next = next_param;
     *last_loc = ele;
+    table_insert(&param_table, name, ele);
 }
 
 /* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
-{
-    /*
-     * Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
+/*
+ * Split line into words in place, terminating each with a null character.
+ * Returns the number of words stored in argv, or -1 if there are more
+ * than MAXARGS.
+ */
+static int parse_args(char *line, char *argv[])
+{
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
+    char *src = line;
+    for (;;) {
+        while (isspace((unsigned char) *src))
+            src++;
+        if (!*src)
+            return argc;
+        if (argc == MAXARGS)
+            return -1;
+
+        /* Hit start of new word */
+        argv[argc++] = src;
+        while (*src && !isspace((unsigned char) *src))
+            src++;
+        if (!*src)
+            return argc;
+        /* Hit end of word */
+        *src++ = '\0';
     }
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
+/*
+ * Latency histograms, log-linear as in HdrHistogram.  Each value below
+ * sub_count ns has its own bucket, and each later power of two range is
+ * split into sub_count buckets, so any value is known within 1/sub_count
+ * of itself.  Recording is a few instructions on top of reading the clock.
+ */
+#define sub_bits 4
+#define sub_count (1 << sub_bits)
+#define bucket_count ((64 - sub_bits + 1) * sub_count)
+
+typedef struct LATENCY {
+    uint64_t count;
+    int64_t sum, max; /* In ns */
+    uint64_t buckets[bucket_count];
+} latency_t;
 
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+static inline int64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline int bucket_of(uint64_t ns)
+{
+    if (ns < sub_count)
+        return ns;
+    int k = 63 - __builtin_clzll(ns);
+    return (k - sub_bits + 1) * sub_count +
+           (int) ((ns >> (k - sub_bits)) & (sub_count - 1));
+}
+
+/* Middle of the values falling in bucket */
+static int64_t bucket_value(int bucket)
+{
+    if (bucket < sub_count)
+        return bucket;
+    int k = bucket / sub_count + sub_bits - 1;
+    int64_t width = (int64_t) 1 << (k - sub_bits);
+    return (sub_count + bucket % sub_count) * width + width / 2;
+}
+
+static void record_latency(cmd_ptr cmd, int64_t ns)
+{
+    if (!cmd->latency)
+        cmd->latency = calloc_or_fail(1, sizeof(latency_t), "record_latency");
+    latency_t *l = cmd->latency;
+    if (ns < 0)
+        ns = 0;
+    l->count++;
+    l->sum += ns;
+    if (ns > l->max)
+        l->max = ns;
+    l->buckets[bucket_of(ns)]++;
+}
+
+/* Smallest value at or above fraction p of the recorded ones */
+static int64_t latency_percentile(const latency_t *l, double p)
+{
+    uint64_t rank = (uint64_t) (p * l->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < bucket_count; i++) {
+        seen += l->buckets[i];
+        if (seen >= rank) {
+            int64_t v = bucket_value(i);
+            return v < l->max ? v : l->max;
+        }
+    }
+    return l->max;
 }
 
 static void record_error()
@@ -179,12 +327,14 @@ static bool interpret_cmda(int argc, char *argv[])
     if (argc == 0)
         return true;
     /* Try to find matching command */
-    cmd_ptr next_cmd = cmd_list;
+    cmd_ptr next_cmd = table_find(&cmd_table, argv[0]);
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        int64_t start = now_ns();
         ok = next_cmd->operation(argc, argv);
+        /* quit frees the command list */
+        if (!quit_flag)
+            record_latency(next_cmd, now_ns() - start);
         if (!ok)
             record_error();
     } else {
@@ -196,6 +346,245 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/*
+ * Script blocks and variables, as in
+ *
+ *     let n 0
+ *     repeat 1000 {
+ *         choose {
+ *             ih RAND
+ *             rt
+ *         }
+ *         add n 1
+ *     }
+ *
+ * A block is collected line by line, each line split into words once and
+ * copied, and then runs as often as its header asks without any further
+ * parsing.  Words of the form $name are replaced by the value of integer
+ * variable name each time their line runs.
+ */
+typedef struct BLOCK block_t;
+
+typedef struct {
+    int argc;
+    char **argv;    /* Words, stored in the same allocation after argv */
+    size_t size;    /* Bytes of that allocation */
+    bool expand;    /* Some word names a variable */
+    block_t *block; /* Block opened by this line, or NULL */
+} script_line_t;
+
+struct BLOCK {
+    script_line_t header; /* Line opening the block, less its "{" */
+    script_line_t *lines;
+    int count, alloc;
+    block_t *parent; /* Enclosing block, while collecting */
+};
+
+/* Innermost block being collected, or NULL */
+static block_t *collecting = NULL;
+
+typedef struct VAR var_t;
+struct VAR {
+    char *name;
+    int value;
+    var_t *next;
+};
+
+static var_t *var_list = NULL;
+static name_table_t var_table;
+
+/* Longest decimal int, with sign and null character */
+#define VALUE_SIZE 12
+
+static script_line_t make_line(int argc, char *argv[])
+{
+    script_line_t line = {.argc = argc, .size = argc * sizeof(char *)};
+    for (int i = 0; i < argc; i++)
+        line.size += strlen(argv[i]) + 1;
+
+    line.argv = malloc_or_fail(line.size, "make_line");
+    char *dst = (char *) (line.argv + argc);
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        line.argv[i] = memcpy(dst, argv[i], len);
+        dst += len;
+        line.expand |= argv[i][0] == '$';
+    }
+    return line;
+}
+
+static void free_block_tree(block_t *b);
+
+static void free_line(script_line_t *line)
+{
+    if (line->block)
+        free_block_tree(line->block);
+    else
+        free_block(line->argv, line->size);
+}
+
+static void free_block_tree(block_t *b)
+{
+    for (int i = 0; i < b->count; i++)
+        free_line(&b->lines[i]);
+    if (b->alloc)
+        free_array(b->lines, b->alloc, sizeof(script_line_t));
+    free_line(&b->header);
+    free_block(b, sizeof(block_t));
+}
+
+static var_t *find_var(const char *name)
+{
+    return table_find(&var_table, name);
+}
+
+static void set_var(char *name, int value)
+{
+    var_t *v = find_var(name);
+    if (!v) {
+        v = malloc_or_fail(sizeof(var_t), "set_var");
+        v->name = strsave_or_fail(name, "set_var");
+        v->next = var_list;
+        var_list = v;
+        table_insert(&var_table, v->name, v);
+    }
+    v->value = value;
+}
+
+/*
+ * Replace variable references among words by their values, printed into
+ * values.  Return false if some variable is not set.
+ */
+static bool expand(int argc,
+                   char *argv[],
+                   char *words[],
+                   char values[][VALUE_SIZE])
+{
+    for (int i = 0; i < argc; i++) {
+        words[i] = argv[i];
+        if (argv[i][0] != '$')
+            continue;
+
+        var_t *v = find_var(argv[i] + 1);
+        if (!v) {
+            report(1, "Unknown variable '%s'", argv[i] + 1);
+            record_error();
+            return false;
+        }
+        snprintf(values[i], VALUE_SIZE, "%d", v->value);
+        words[i] = values[i];
+    }
+    return true;
+}
+
+static bool run_block(block_t *b);
+
+static bool run_line(script_line_t *line)
+{
+    if (line->block)
+        return run_block(line->block);
+    if (!line->expand)
+        return interpret_cmda(line->argc, line->argv);
+
+    char *words[MAXARGS];
+    char values[MAXARGS][VALUE_SIZE];
+    return expand(line->argc, line->argv, words, values) &&
+           interpret_cmda(line->argc, words);
+}
+
+static bool run_block(block_t *b)
+{
+    char *words[MAXARGS];
+    char values[MAXARGS][VALUE_SIZE];
+    int argc = b->header.argc;
+    if (!expand(argc, b->header.argv, words, values))
+        return false;
+
+    if (argc == 1 && !strcmp(words[0], "choose")) {
+        return !b->count ||
+               run_line(&b->lines[random_below(b->count)]);
+    }
+
+    int times;
+    if (argc != 2 || strcmp(words[0], "repeat")) {
+        report(1, "Expected 'repeat N {' or 'choose {' to open block");
+        record_error();
+        return false;
+    }
+    if (!get_int(words[1], &times) || times < 0) {
+        report(1, "Invalid repeat count '%s'", words[1]);
+        record_error();
+        return false;
+    }
+
+    for (int i = 0; i < times && !quit_flag; i++) {
+        for (int j = 0; j < b->count && !quit_flag; j++)
+            run_line(&b->lines[j]);
+    }
+    return true;
+}
+
+/* Add a line to the block being collected, running the block once closed */
+static bool collect(int argc, char *argv[])
+{
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        block_t *b = collecting;
+        collecting = b->parent;
+        if (collecting)
+            return true;
+
+        bool ok = run_block(b);
+        free_block_tree(b);
+        return ok;
+    }
+    if (!argc)
+        return true;
+
+    block_t *b = collecting;
+    if (b->count == b->alloc) {
+        int alloc = b->alloc ? 2 * b->alloc : 8;
+        script_line_t *lines =
+            calloc_or_fail(alloc, sizeof(script_line_t), "collect");
+        if (b->alloc) {
+            memcpy(lines, b->lines, b->count * sizeof(script_line_t));
+            free_array(b->lines, b->alloc, sizeof(script_line_t));
+        }
+        b->lines = lines;
+        b->alloc = alloc;
+    }
+
+    script_line_t *line = &b->lines[b->count++];
+    if (strcmp(argv[argc - 1], "{")) {
+        *line = make_line(argc, argv);
+        return true;
+    }
+
+    /* Nested block */
+    *line = (script_line_t){0};
+    line->block = calloc_or_fail(1, sizeof(block_t), "collect");
+    line->block->header = make_line(argc - 1, argv);
+    line->block->parent = b;
+    collecting = line->block;
+    return true;
+}
+
+/* Run the words of one input line, or collect them into a block */
+static bool interpret_line(int argc, char *argv[])
+{
+    if (collecting)
+        return collect(argc, argv);
+
+    if (argc && !strcmp(argv[argc - 1], "{")) {
+        collecting = calloc_or_fail(1, sizeof(block_t), "interpret_line");
+        collecting->header = make_line(argc - 1, argv);
+        return true;
+    }
+
+    char *words[MAXARGS];
+    char values[MAXARGS][VALUE_SIZE];
+    return expand(argc, argv, words, values) && interpret_cmda(argc, words);
+}
+
 /* Execute a command from a command line */
 static bool interpret_cmd(char *cmdline)
 {
@@ -205,14 +594,15 @@ static bool interpret_cmd(char *cmdline)
 #if RPT >= 6
     report(6, "Interpreting command '%s'\n", cmdline);
 #endif
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    char *argv[MAXARGS];
+    int argc = parse_args(cmdline, argv);
+    if (argc < 0) {
+        report(1, "Too many arguments (at most %d)", MAXARGS);
+        record_error();
+        return false;
+    }
 
-    return ok;
+    return interpret_line(argc, argv);
 }
 
 /* Set function to be executed as part of program exit */
@@ -238,6 +628,8 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_ptr ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(latency_t));
         free_block(ele, sizeof(cmd_ele));
     }
 
@@ -247,14 +639,34 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_ele));
     }
+    table_clear(&cmd_table);
+    table_clear(&param_table);
+
+    if (collecting) {
+        report(1, "Block left open at end of input");
+        while (collecting->parent)
+            collecting = collecting->parent;
+        free_block_tree(collecting);
+        collecting = NULL;
+        ok = false;
+    }
 
-    while (buf_stack)
-        pop_file();
+    while (var_list) {
+        var_t *v = var_list;
+        var_list = v->next;
+        free_string(v->name);
+        free_block(v, sizeof(var_t));
+    }
+    table_clear(&var_table);
 
     for (int i = 0; i < quit_helper_cnt; i++) {
-        ok = ok && quit_helpers[i](argc, argv);
+        ok = quit_helpers[i](argc, argv) && ok;
     }
 
+    /* After the helpers, as argv may point into a mapped file */
+    while (buf_stack)
+        pop_file();
+
     quit_flag = true;
     return ok;
 }
@@ -328,17 +740,14 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_ptr plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        /* Find parameter in table */
+        param_ptr plist = table_find(&param_table, name);
+        if (plist) {
+            int oldval = *plist->valp;
+            *plist->valp = value;
+            if (plist->setter)
+                plist->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -379,6 +788,116 @@ static bool do_log(int argc, char *argv[])
     return result;
 }
 
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+        report(1, "%s takes no argument, or reset", argv[0]);
+        return false;
+    }
+
+    if (argc == 2) {
+        for (cmd_ptr c = cmd_list; c; c = c->next) {
+            if (c->latency)
+                memset(c->latency, 0, sizeof(latency_t));
+        }
+        return true;
+    }
+
+    report(1, "%-12s %10s %12s %12s %12s %12s", "command", "count", "mean us",
+           "p50 us", "p99 us", "max us");
+    for (cmd_ptr c = cmd_list; c; c = c->next) {
+        const latency_t *l = c->latency;
+        if (!l || !l->count)
+            continue;
+        report(1, "%-12s %10" PRIu64 " %12.1f %12.1f %12.1f %12.1f", c->name,
+               l->count, l->sum / 1e3 / l->count,
+               latency_percentile(l, 0.5) / 1e3,
+               latency_percentile(l, 0.99) / 1e3, l->max / 1e3);
+    }
+    return true;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int times;
+    if (argc < 3) {
+        report(1, "%s takes a count and a command", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &times) || times < 0) {
+        report(1, "Invalid repeat count '%s'", argv[1]);
+        return false;
+    }
+
+    for (int i = 0; i < times && !quit_flag; i++)
+        interpret_cmda(argc - 2, argv + 2);
+    return true;
+}
+
+static bool do_choose(int argc, char *argv[])
+{
+    report(1, "%s only opens a block, as in '%s {'", argv[0], argv[0]);
+    return false;
+}
+
+static bool do_let(int argc, char *argv[])
+{
+    int value;
+    if (argc != 3) {
+        report(1, "%s takes 2 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[2], &value)) {
+        report(1, "Invalid value '%s'", argv[2]);
+        return false;
+    }
+
+    set_var(argv[1], value);
+    return true;
+}
+
+static bool do_add(int argc, char *argv[])
+{
+    int delta;
+    if (argc != 3) {
+        report(1, "%s takes 2 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[2], &delta)) {
+        report(1, "Invalid value '%s'", argv[2]);
+        return false;
+    }
+
+    var_t *v = find_var(argv[1]);
+    if (!v) {
+        report(1, "Unknown variable '%s'", argv[1]);
+        return false;
+    }
+    int sum;
+    if (__builtin_add_overflow(v->value, delta, &sum)) {
+        report(1, "Overflow adding %d to '%s'", delta, argv[1]);
+        return false;
+    }
+    v->value = sum;
+    return true;
+}
+
+static bool do_rand(int argc, char *argv[])
+{
+    int n;
+    if (argc != 3) {
+        report(1, "%s takes 2 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[2], &n) || n < 1) {
+        report(1, "Invalid range '%s'", argv[2]);
+        return false;
+    }
+
+    set_var(argv[1], (int) random_below(n));
+    return true;
+}
+
 static bool do_time(int argc, char *argv[])
 {
     double delta = delta_time(&last_time);
@@ -404,6 +923,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    table_clear(&cmd_table);
+    table_clear(&param_table);
     err_cnt = 0;
     quit_flag = false;
 
@@ -413,6 +934,18 @@ void init_cmd()
     ADD_COMMAND(source, " file           | Read commands from source file");
     ADD_COMMAND(log, " file           | Copy output to file");
     ADD_COMMAND(time, " cmd arg ...    | Time command execution");
+    ADD_COMMAND(repeat,
+                " n cmd arg ...  | Run command n times.  'repeat n {' on a "
+                "line of its own repeats the lines up to '}'");
+    ADD_COMMAND(choose, " {              | Run one random line of those up "
+                        "to '}'");
+    ADD_COMMAND(let, " var val        | Set variable, used as $var in "
+                     "later commands");
+    ADD_COMMAND(add, " var val        | Add val to variable");
+    ADD_COMMAND(rand, " var n          | Set variable to a random number "
+                      "below n");
+    ADD_COMMAND(stats,
+                " [reset]        | Show or clear latency of each command");
     add_cmd("#", do_comment_cmd, " ...            | Display comment");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
     add_param("verbose", &verblevel, "Verbosity level", NULL);
@@ -442,7 +975,21 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->cnt = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->tail = NULL;
     rnew->prev = buf_stack;
+
+    /* Private mapping, so lines can be terminated and split in place */
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                         fd, 0);
+        if (map != MAP_FAILED) {
+            rnew->map = map;
+            rnew->map_size = st.st_size;
+            rnew->map_pos = 0;
+        }
+    }
     buf_stack = rnew;
 
     return true;
@@ -454,6 +1001,10 @@ static void pop_file()
     if (buf_stack) {
         rio_ptr rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
+        if (rsave->tail)
+            free_block(rsave->tail, rsave->tail_size);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -465,6 +1016,38 @@ static void init_in()
     buf_stack = NULL;
 }
 
+/* Hand out the next line of a mapped file, terminated in place */
+static char *map_readline()
+{
+    rio_ptr r = buf_stack;
+    if (r->map_pos == r->map_size) {
+        pop_file();
+        return NULL;
+    }
+
+    char *line = r->map + r->map_pos;
+    size_t left = r->map_size - r->map_pos;
+    char *end = memchr(line, '\n', left);
+    if (end) {
+        *end = '\0';
+        r->map_pos += end - line + 1;
+    } else {
+        /* No room to terminate the last line within the mapping */
+        r->tail_size = left + 1;
+        r->tail = malloc_or_fail(r->tail_size, "readline");
+        memcpy(r->tail, line, left);
+        r->tail[left] = '\0';
+        line = r->tail;
+        r->map_pos = r->map_size;
+    }
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%s\n", line);
+    }
+    return line;
+}
+
 /* Read command from input file.
  * When hit EOF, close that file and return NULL
  */
@@ -476,6 +1059,8 @@ static char *readline()
 
     if (!buf_stack)
         return NULL;
+    if (buf_stack->map)
+        return map_readline();
 
     for (cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
         if (buf_stack->cnt <= 0) {
@@ -659,8 +1244,304 @@ void completion(const char *buf, linenoiseCompletions *lc)
     }
 }
 
+/*
+ * Compiled traces.
+ *
+ * A compiled trace holds the commands of a text trace already split into
+ * words, so that replaying it skips reading and tokenizing lines.  Words
+ * and lines are interned in a pool of null-terminated strings, referred to
+ * by offset.  The file has, in host byte order, a trace_header_t, ninsns
+ * trace_insn_t, nargs pool offsets of words, then pool_size bytes of pool.
+ */
+#define TRACE_MAGIC "qtrace\0\1"
+
+typedef struct {
+    char magic[8];      /* TRACE_MAGIC */
+    uint32_t ninsns;    /* One instruction per line of the text trace */
+    uint32_t nargs;     /* Words over all instructions */
+    uint32_t pool_size; /* Bytes of strings, starting with an empty one */
+} trace_header_t;
+
+typedef struct {
+    uint32_t line; /* Pool offset of the line, as echoed */
+    uint32_t argc;
+    uint32_t args; /* Index of the first word in the word offsets */
+} trace_insn_t;
+
+/* Growable byte buffer used while compiling */
+typedef struct {
+    char *data;
+    size_t size, alloc;
+} trace_buf_t;
+
+/* Pool offsets of interned strings, hashed by content.  0 marks empty */
+typedef struct {
+    uint32_t *slots;
+    size_t size, count;
+} intern_table_t;
+
+static void buf_append(trace_buf_t *b, const void *p, size_t len)
+{
+    if (b->size + len > b->alloc) {
+        size_t alloc = b->alloc ? b->alloc : 4096;
+        while (alloc < b->size + len)
+            alloc *= 2;
+        char *data = malloc_or_fail(alloc, "buf_append");
+        if (b->data) {
+            memcpy(data, b->data, b->size);
+            free_block(b->data, b->alloc);
+        }
+        b->data = data;
+        b->alloc = alloc;
+    }
+    memcpy(b->data + b->size, p, len);
+    b->size += len;
+}
+
+static void buf_free(trace_buf_t *b)
+{
+    if (b->data)
+        free_block(b->data, b->alloc);
+}
+
+static uint32_t *intern_slot(intern_table_t *t,
+                             const trace_buf_t *pool,
+                             const char *s)
+{
+    size_t mask = t->size - 1;
+    for (size_t i = name_hash(s) & mask;; i = (i + 1) & mask) {
+        if (!t->slots[i] || !strcmp(pool->data + t->slots[i], s))
+            return &t->slots[i];
+    }
+}
+
+/* Pool offset of s, adding it to pool on first use */
+static uint32_t intern(intern_table_t *t, trace_buf_t *pool, const char *s)
+{
+    if (!*s)
+        return 0;
+
+    if (2 * (t->count + 1) > t->size) {
+        intern_table_t old = *t;
+        t->size = old.size ? 2 * old.size : 1024;
+        t->slots = calloc_or_fail(t->size, sizeof(uint32_t), "intern");
+        for (size_t i = 0; i < old.size; i++) {
+            if (old.slots[i])
+                *intern_slot(t, pool, pool->data + old.slots[i]) =
+                    old.slots[i];
+        }
+        if (old.slots)
+            free_array(old.slots, old.size, sizeof(uint32_t));
+    }
+
+    uint32_t *slot = intern_slot(t, pool, s);
+    if (!*slot) {
+        *slot = pool->size;
+        buf_append(pool, s, strlen(s) + 1);
+        t->count++;
+    }
+    return *slot;
+}
+
+/* Compile the text trace in infile_name into outfile_name */
+bool compile_trace(char *infile_name, char *outfile_name)
+{
+    rio_ptr outer = buf_stack;
+    bool had_infile = has_infile;
+    if (!push_file(infile_name)) {
+        has_infile = had_infile;
+        report(1, "ERROR: Could not open source file '%s'", infile_name);
+        return false;
+    }
+
+    trace_buf_t insns = {0}, args = {0}, pool = {0};
+    intern_table_t strings = {0};
+    buf_append(&pool, "", 1);
+
+    /* Read lines just as when running the trace, without echoing them */
+    int old_echo = echo;
+    echo = 0;
+    bool ok = true;
+    unsigned lineno = 0;
+    while (buf_stack != outer) {
+        char *line = readline();
+        if (!line)
+            continue;
+        lineno++;
+        size_t len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        trace_insn_t insn = {
+            .line = intern(&strings, &pool, line),
+            .args = args.size / sizeof(uint32_t),
+        };
+        char *argv[MAXARGS];
+        int argc = parse_args(line, argv);
+        if (argc < 0) {
+            report(1, "ERROR: %s:%u: Too many arguments (at most %d)",
+                   infile_name, lineno, MAXARGS);
+            ok = false;
+            while (buf_stack != outer)
+                pop_file();
+            break;
+        }
+
+        insn.argc = argc;
+        for (int i = 0; i < argc; i++) {
+            uint32_t offset = intern(&strings, &pool, argv[i]);
+            buf_append(&args, &offset, sizeof(offset));
+        }
+        buf_append(&insns, &insn, sizeof(insn));
+    }
+    echo = old_echo;
+    has_infile = had_infile;
+
+    if (ok && pool.size > UINT32_MAX) {
+        report(1, "ERROR: Trace '%s' too large to compile", infile_name);
+        ok = false;
+    }
+
+    if (ok) {
+        trace_header_t header = {
+            .magic = TRACE_MAGIC,
+            .ninsns = insns.size / sizeof(trace_insn_t),
+            .nargs = args.size / sizeof(uint32_t),
+            .pool_size = pool.size,
+        };
+        FILE *out = fopen(outfile_name, "wb");
+        ok = out && fwrite(&header, sizeof(header), 1, out) == 1 &&
+             fwrite(insns.data, 1, insns.size, out) == insns.size &&
+             fwrite(args.data, 1, args.size, out) == args.size &&
+             fwrite(pool.data, 1, pool.size, out) == pool.size;
+        if (out && fclose(out))
+            ok = false;
+        if (!ok)
+            report(1, "ERROR: Could not write compiled trace '%s'",
+                   outfile_name);
+    }
+
+    buf_free(&insns);
+    buf_free(&args);
+    buf_free(&pool);
+    if (strings.slots)
+        free_array(strings.slots, strings.size, sizeof(uint32_t));
+    return ok;
+}
+
+/* Whether the file named fname starts as a compiled trace */
+static bool is_compiled(char *fname)
+{
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool compiled = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                    !memcmp(magic, TRACE_MAGIC, sizeof(magic));
+    close(fd);
+    return compiled;
+}
+
+/* Read the whole of file fname, or return NULL */
+static char *read_compiled(char *fname, size_t *sizep)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    char *data = NULL;
+    if (!fstat(fd, &st) && st.st_size > 0) {
+        size_t size = st.st_size, done = 0;
+        data = malloc_or_fail(size, "read_compiled");
+        while (done < size) {
+            ssize_t got = read(fd, data + done, size - done);
+            if (got <= 0)
+                break;
+            done += got;
+        }
+        if (done < size) {
+            free_block(data, size);
+            data = NULL;
+        }
+        *sizep = size;
+    }
+    close(fd);
+    return data;
+}
+
+/* Replay compiled trace in fname, with the same effect as its text */
+static bool run_compiled(char *fname)
+{
+    size_t size;
+    char *data = read_compiled(fname, &size);
+    if (!data) {
+        report(1, "ERROR: Could not read compiled trace '%s'", fname);
+        return false;
+    }
+
+    /* Check every offset up front, so replay needs no checks */
+    const trace_header_t *header = (const trace_header_t *) data;
+    bool valid = size >= sizeof(*header);
+    valid = valid && header->pool_size &&
+            size == sizeof(*header) +
+                        (uint64_t) header->ninsns * sizeof(trace_insn_t) +
+                        (uint64_t) header->nargs * sizeof(uint32_t) +
+                        header->pool_size;
+    const trace_insn_t *insns = NULL;
+    const uint32_t *args = NULL;
+    char *pool = NULL;
+    if (valid) {
+        insns = (const trace_insn_t *) (header + 1);
+        args = (const uint32_t *) (insns + header->ninsns);
+        pool = (char *) (args + header->nargs);
+        valid = !pool[header->pool_size - 1];
+    }
+    for (uint32_t i = 0; valid && i < header->ninsns; i++) {
+        valid = insns[i].line < header->pool_size &&
+                insns[i].argc <= MAXARGS &&
+                insns[i].args <= header->nargs &&
+                insns[i].argc <= header->nargs - insns[i].args;
+    }
+    for (uint32_t i = 0; valid && i < header->nargs; i++)
+        valid = args[i] < header->pool_size;
+    if (!valid) {
+        report(1, "ERROR: Malformed compiled trace '%s'", fname);
+        free_block(data, size);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->ninsns && !quit_flag; i++) {
+        const trace_insn_t *insn = &insns[i];
+        if (echo) {
+            report_noreturn(1, prompt);
+            report_noreturn(1, "%s\n", pool + insn->line);
+        }
+#if RPT >= 6
+        report(6, "Interpreting command '%s'\n", pool + insn->line);
+#endif
+        char *argv[MAXARGS];
+        for (uint32_t j = 0; j < insn->argc; j++)
+            argv[j] = pool + args[insn->args + j];
+        interpret_line(insn->argc, argv);
+
+        /* Run any text trace the command pushed, as source does */
+        while (buf_stack && !quit_flag) {
+            char *cmdline = readline();
+            if (cmdline)
+                interpret_cmd(cmdline);
+        }
+    }
+
+    free_block(data, size);
+    return err_cnt == 0;
+}
+
 bool run_console(char *infile_name)
 {
+    if (infile_name && is_compiled(infile_name))
+        return run_compiled(infile_name);
+
     if (!push_file(infile_name)) {
         report(1, "ERROR: Could not open source file '%s'", infile_name);
         return false;
@@ -669,8 +1550,9 @@ bool run_console(char *infile_name)
     if (!has_infile) {
         char *cmdline;
         while (noise && (cmdline = linenoise(prompt)) != NULL) {
+            /* Add to the history before parsing splits the line. */
+            linenoiseHistoryAdd(cmdline);
             interpret_cmd(cmdline);
-            linenoiseHistoryAdd(cmdline);       /* Add to the history. */
             linenoiseHistorySave(HISTORY_FILE); /* Save the history on disk. */
             linenoiseFree(cmdline);
         }
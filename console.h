@@ -23,6 +23,8 @@ struct CELE {
     char *name;
     cmd_function operation;
     char *documentation;
+    /* Histogram of execution times, allocated on first execution */
+    struct LATENCY *latency;
     cmd_ptr next;
 };
 
@@ -81,6 +83,12 @@ int cmd_select(int nfds,
  */
 bool run_console(char *infile_name);
 
+/*
+ * Compile the text trace in infile_name into outfile_name, which
+ * run_console() then replays without parsing
+ */
+bool compile_trace(char *infile_name, char *outfile_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, linenoiseCompletions *lc);
 
@@ -0,0 +1,136 @@
+/*
+ * Microbenchmarks of queue operations.
+ *
+ * Each run builds its queue outside the timed region, times the operation
+ * with clock_gettime, and frees whatever is left of the queue.  A tenth of
+ * the runs, and at least one, are first spent as warm-up, so that caches,
+ * branch predictors and the allocator reach a steady state.  Allocations
+ * are counted through the harness around the timed region only.
+ */
+
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+#include "../random.h"
+#include "constant.h"
+#include "cpucycles.h"
+
+/* Generated data comes from the system allocator */
+#define INTERNAL 1
+#include "harness.h"
+#include "queue.h"
+#include "values.h"
+
+/* Distinct values of duplicate-heavy data */
+#define dup_values 16
+
+static const char *data_names[number_bench_data] = {
+    "random",
+    "sorted",
+    "reversed",
+    "dup",
+};
+
+const char *bench_data_name(bench_data_t data)
+{
+    return data_names[data];
+}
+
+static int ascending(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+static int descending(const void *a, const void *b)
+{
+    return strcmp(b, a);
+}
+
+static void generate(value_t *values, int n, bench_data_t data)
+{
+    if (data != bench_dup) {
+        random_values(values, n);
+        if (data == bench_sorted)
+            qsort(values, n, sizeof(value_t), ascending);
+        else if (data == bench_reversed)
+            qsort(values, n, sizeof(value_t), descending);
+        return;
+    }
+
+    value_t few[dup_values];
+    random_values(few, dup_values);
+    uint8_t pick[256];
+    for (int i = 0; i < n; i++) {
+        if (i % sizeof(pick) == 0)
+            randombytes(pick, sizeof(pick));
+        memcpy(values[i], few[pick[i % sizeof(pick)] % dup_values],
+               value_size);
+    }
+}
+
+/* Time one run of operation op, adding its allocations to allocs */
+static int64_t time_run(const dut_op_t *op,
+                        value_t *values,
+                        int n,
+                        size_t *allocs)
+{
+    struct list_head *head = q_new();
+    if (!(op->flags & dut_fills)) {
+        for (int i = 0; i < n; i++)
+            q_insert_tail(head, values[i]);
+    }
+
+    /* Inserting and removing operations fill or empty the queue */
+    int times = op->flags & (dut_fills | dut_drains) ? n : 1;
+    size_t before_allocs = allocation_attempts();
+    int64_t before = clock_ns();
+    for (int i = 0; i < times; i++)
+        op->apply(head, values[i]);
+    int64_t after = clock_ns();
+    *allocs += allocation_attempts() - before_allocs;
+
+    if (!(op->flags & dut_consumes))
+        q_free(head);
+    return after - before;
+}
+
+bool bench_run(const char *op,
+               int n,
+               bench_data_t data,
+               int iterations,
+               bench_result_t *r)
+{
+    int i = dut_find_command(op);
+    if (i < 0)
+        return false;
+
+    value_t *values = malloc((size_t) n * sizeof(value_t));
+    int64_t *times = malloc(iterations * sizeof(int64_t));
+    if (!values || !times) {
+        free(values);
+        free(times);
+        return false;
+    }
+    generate(values, n, data);
+
+    size_t allocs = 0;
+    int warmup = iterations / 10 ? iterations / 10 : 1;
+    for (int k = 0; k < warmup; k++)
+        time_run(&dut_ops[i], values, n, &allocs);
+
+    allocs = 0;
+    for (int k = 0; k < iterations; k++)
+        times[k] = time_run(&dut_ops[i], values, n, &allocs);
+    qsort(times, iterations, sizeof(int64_t), cmp_int64);
+
+    r->min = times[0];
+    r->median = times[iterations / 2];
+    /* Nearest rank */
+    r->p99 = times[(99 * (size_t) iterations + 99) / 100 - 1];
+    r->ns_per_element = (double) r->median / n;
+    r->allocs = (double) allocs / iterations;
+
+    free(values);
+    free(times);
+    return true;
+}
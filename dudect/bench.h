@@ -0,0 +1,39 @@
+#ifndef DUDECT_BENCH_H
+#define DUDECT_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Contents of the queue a benchmark runs on */
+typedef enum {
+    bench_random,   /* Distinct random strings */
+    bench_sorted,   /* The same, in ascending order */
+    bench_reversed, /* The same, in descending order */
+    bench_dup,      /* Random strings drawn from only a few values */
+    number_bench_data,
+} bench_data_t;
+
+typedef struct {
+    int64_t min, median, p99; /* Time of one run, in ns */
+    double ns_per_element;    /* Median time divided by queue size */
+    double allocs;            /* Allocations per run */
+} bench_result_t;
+
+/* Name of data, such as "sorted" */
+const char *bench_data_name(bench_data_t data);
+
+/*
+ * Time iterations runs of operation op, named as the qtest command running
+ * it in dut_ops, on queues of n elements filled with data, after untimed
+ * warm-up runs.
+ * Inserting and removing operations run n times, so as to fill or empty the
+ * queue; others run once on the full queue.  Return false if op is unknown
+ * or the data does not fit in memory.
+ */
+bool bench_run(const char *op,
+               int n,
+               bench_data_t data,
+               int iterations,
+               bench_result_t *r);
+
+#endif
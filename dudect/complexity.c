@@ -0,0 +1,197 @@
+/*
+ * Empirical time complexity of queue operations.
+ *
+ * An operation is timed on queues whose size doubles from min_size up to
+ * complexity_max.  Each size is measured repeats times on a freshly built
+ * queue, and the median is kept to shrug off interrupts.
+ *
+ * Each doubling of the size then votes for the model whose growth ratio
+ * f(2n) / f(n) is closest to the measured one, on a log scale.  The cost of
+ * touching a node jumps several times over as the queue outgrows each cache
+ * level; comparing ratios step by step confines such a jump to the one step
+ * it happens in, where least squares over all sizes would read it as faster
+ * growth.  The share of steps won is the confidence, and the winning model
+ * time = a + b * f(n) is finally fitted by least squares, weighting each
+ * point by 1 / time^2 so that errors are relative.
+ */
+
+#include "complexity.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "constant.h"
+#include "cpucycles.h"
+#include "queue.h"
+#include "values.h"
+
+/* Smallest measured queue size */
+#define min_size 64
+
+/* Measurements of each size, the median of which is kept */
+#define repeats 15
+
+/* Distinct values inserted into measured queues */
+#define pool_size 256
+
+int complexity_max = 8192;
+
+static value_t pool[pool_size];
+
+static const char *names[number_models] = {
+    "O(1)", "O(log n)", "O(n)", "O(n log n)", "O(n^2)",
+};
+
+const char *complexity_name(complexity_model_t model)
+{
+    return names[model];
+}
+
+static double model_value(complexity_model_t model, double n)
+{
+    switch (model) {
+    case model_log:
+        return log2(n);
+    case model_n:
+        return n;
+    case model_nlogn:
+        return n * log2(n);
+    case model_n2:
+        return n * n;
+    default:
+        return 1;
+    }
+}
+
+/* Evict head and all elements of it from the caches */
+static void flush_queue(struct list_head *head)
+{
+    struct list_head *li;
+    list_for_each (li, head) {
+        element_t *e = list_entry(li, element_t, list);
+        cache_flush(e->value);
+        cache_flush(e);
+    }
+    cache_flush(head);
+    cache_fence();
+}
+
+/* Bare cycle counter reads are not ordered against short operations */
+static inline int64_t start(void)
+{
+    return timer_backend == timer_rdtsc ? cpucycles_start()
+                                        : timer_start(timer_backend);
+}
+
+static inline int64_t end(void)
+{
+    return timer_backend == timer_rdtsc ? cpucycles_end()
+                                        : timer_end(timer_backend);
+}
+
+/* Median time of operation op on queues of size n */
+static double measure_size(const dut_op_t *op, int n)
+{
+    int64_t times[repeats];
+    for (int r = 0; r < repeats; r++) {
+        struct list_head *head = q_new();
+        for (int i = 0; i < n; i++)
+            q_insert_tail(head, pool[i % pool_size]);
+        if (op->flags & dut_sorted)
+            q_sort(head);
+        flush_queue(head);
+
+        int64_t before = start();
+        op->apply(head, pool[0]);
+        int64_t after = end();
+        times[r] = after - before - timer_overhead;
+
+        if (!(op->flags & dut_consumes))
+            q_free(head);
+    }
+    qsort(times, repeats, sizeof(int64_t), cmp_int64);
+    return times[repeats / 2];
+}
+
+/*
+ * Weighted least squares fit of time = a + b * model(n).
+ * A model with a negative slope is fitted as a constant instead.
+ */
+static void fit(const complexity_t *c,
+                complexity_model_t model,
+                double *a,
+                double *b)
+{
+    double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < c->sizes; i++) {
+        /* Clamp so that a single zero reading cannot dominate */
+        double y = c->time[i] < 1 ? 1 : c->time[i];
+        double w = 1 / (y * y);
+        double x = model_value(model, c->n[i]);
+        sw += w;
+        sx += w * x;
+        sy += w * y;
+        sxx += w * x * x;
+        sxy += w * x * y;
+    }
+
+    double det = sw * sxx - sx * sx;
+    *b = model == model_1 || det <= 0 ? 0 : (sw * sxy - sx * sy) / det;
+    if (*b < 0)
+        *b = 0;
+    *a = (sy - *b * sx) / sw;
+}
+
+static void choose_model(complexity_t *c)
+{
+    double votes[number_models] = {0};
+    int steps = c->sizes - 1;
+    for (int i = 0; i < steps; i++) {
+        /* Clamp so that a zero reading cannot dominate */
+        double from = c->time[i] < 1 ? 1 : c->time[i];
+        double to = c->time[i + 1] < 1 ? 1 : c->time[i + 1];
+        double growth = log(to / from);
+
+        int nearest = model_1;
+        double best = INFINITY;
+        for (int m = 0; m < number_models; m++) {
+            double d = fabs(growth - log(model_value(m, c->n[i + 1]) /
+                                         model_value(m, c->n[i])));
+            if (d < best) {
+                best = d;
+                nearest = m;
+            }
+        }
+        votes[nearest]++;
+    }
+
+    c->best = model_1;
+    for (int m = 0; m < number_models; m++) {
+        c->confidence[m] = votes[m] / steps;
+        if (votes[m] > votes[c->best])
+            c->best = m;
+    }
+    fit(c, c->best, &c->a, &c->b);
+}
+
+bool complexity_estimate(const char *op, complexity_t *c)
+{
+    int which = dut_find_command(op);
+    if (which < 0)
+        return false;
+
+    timer_setup();
+    random_values(pool, pool_size);
+
+    /* Fitting two parameters takes at least three sizes */
+    c->sizes = 0;
+    for (int n = min_size;
+         (n <= complexity_max || c->sizes < 3) &&
+         c->sizes < complexity_max_sizes;
+         n *= 2) {
+        c->n[c->sizes] = n;
+        c->time[c->sizes] = measure_size(&dut_ops[which], n);
+        c->sizes++;
+    }
+    choose_model(c);
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef DUDECT_COMPLEXITY_H
+#define DUDECT_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Candidate growth models, in order of increasing growth */
+typedef enum {
+    model_1,
+    model_log,
+    model_n,
+    model_nlogn,
+    model_n2,
+    number_models,
+} complexity_model_t;
+
+/* Most queue sizes an estimate may measure */
+#define complexity_max_sizes 20
+
+typedef struct {
+    int sizes;                          /* Number of measured sizes */
+    double n[complexity_max_sizes];     /* Queue size */
+    double time[complexity_max_sizes];  /* Median time of one operation */
+    complexity_model_t best;            /* Model closest to most steps */
+    double a, b;                        /* time ~= a + b * model(n) */
+    double confidence[number_models];   /* Share of steps won by model */
+} complexity_t;
+
+/* Largest queue size the estimator measures */
+extern int complexity_max;
+
+/* Name of model, such as "O(n log n)" */
+const char *complexity_name(complexity_model_t model);
+
+/*
+ * Time operation op, named as the qtest command running it in dut_ops, on
+ * queues of geometrically spaced sizes up to complexity_max, and fit the
+ * models.  Return false if op is unknown.
+ */
+bool complexity_estimate(const char *op, complexity_t *c);
+
+#endif
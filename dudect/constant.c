@@ -20,20 +20,16 @@ const size_t n_measure = N_MEASURE;
 
 const int drop_size = 20;
 
+int dudect_cache = cache_as_is;
+
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Each measuring thread has its own queue and strings.
  */
-static struct list_head *l = NULL;
-
-static char random_string[N_MEASURE][8];
-static int random_string_iter = 0;
+static __thread struct list_head *l = NULL;
 
-enum {
-    test_insert_head,
-    test_insert_tail,
-    test_remove_head,
-    test_remove_tail,
-};
+static __thread char random_string[N_MEASURE][8];
+static __thread int random_string_iter = 0;
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -63,79 +59,264 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/*
+ * State of one measurement, passed from setup to the measured call and on
+ * to teardown.
+ */
+static __thread char *dut_string;
+static __thread element_t *dut_removed;
+
+/* Queue of given size, for operations which take no string */
+static void setup_queue(uint16_t size)
+{
+    dut_new();
+    dut_insert_head(get_random_string(), size);
+}
+
+/* Queue of given size, and a different string to insert into it */
+static void setup_insert(uint16_t size)
+{
+    dut_string = get_random_string();
+    setup_queue(size);
+}
+
+static void run_insert_head(void)
+{
+    dut_insert_head(dut_string, 1);
+}
+
+static void run_insert_tail(void)
+{
+    dut_insert_tail(dut_string, 1);
+}
+
+static void run_remove_head(void)
+{
+    dut_removed = q_remove_head(l, NULL, 0);
+}
+
+static void run_remove_tail(void)
+{
+    dut_removed = q_remove_tail(l, NULL, 0);
+}
+
+static void run_size(void)
+{
+    q_size(l);
+}
+
+static void run_delete_mid(void)
+{
+    q_delete_mid(l);
+}
+
+static void run_swap(void)
+{
+    q_swap(l);
+}
+
+static void run_reverse(void)
+{
+    q_reverse(l);
+}
+
+static void run_delete_dup(void)
+{
+    q_delete_dup(l);
+}
+
+static void run_sort(void)
+{
+    q_sort(l);
+}
+
+static void run_free(void)
+{
+    dut_free();
+}
+
+static void teardown_queue(void)
+{
+    dut_string = NULL;
+    dut_free();
+}
+
+/* Release the element taken off the queue too */
+static void teardown_remove(void)
+{
+    if (dut_removed)
+        q_release_element(dut_removed);
+    dut_removed = NULL;
+    teardown_queue();
+}
+
+/* Queue already freed by the measured call */
+static void teardown_freed(void)
+{
+    dut_string = NULL;
+    l = NULL;
+}
+
+static void apply_ih(struct list_head *head, char *value)
+{
+    q_insert_head(head, value);
+}
+
+static void apply_it(struct list_head *head, char *value)
+{
+    q_insert_tail(head, value);
+}
+
+static void apply_rh(struct list_head *head, char *value)
+{
+    element_t *e = q_remove_head(head, NULL, 0);
+    if (e)
+        q_release_element(e);
+}
+
+static void apply_rt(struct list_head *head, char *value)
+{
+    element_t *e = q_remove_tail(head, NULL, 0);
+    if (e)
+        q_release_element(e);
+}
+
+static void apply_size(struct list_head *head, char *value)
+{
+    q_size(head);
+}
+
+static void apply_dm(struct list_head *head, char *value)
+{
+    q_delete_mid(head);
+}
+
+static void apply_swap(struct list_head *head, char *value)
+{
+    q_swap(head);
+}
+
+static void apply_reverse(struct list_head *head, char *value)
+{
+    q_reverse(head);
+}
+
+static void apply_dedup(struct list_head *head, char *value)
+{
+    q_delete_dup(head);
+}
+
+static void apply_sort(struct list_head *head, char *value)
+{
+    q_sort(head);
+}
+
+static void apply_free(struct list_head *head, char *value)
+{
+    q_free(head);
+}
+
+/* New operations go last, as exported samples record their index */
+const dut_op_t dut_ops[] = {
+    {"insert_head", "ih", setup_insert, run_insert_head, teardown_queue,
+     apply_ih, dut_fills},
+    {"insert_tail", "it", setup_insert, run_insert_tail, teardown_queue,
+     apply_it, dut_fills},
+    {"remove_head", "rh", setup_queue, run_remove_head, teardown_remove,
+     apply_rh, dut_drains},
+    {"remove_tail", "rt", setup_queue, run_remove_tail, teardown_remove,
+     apply_rt, dut_drains},
+    {"size", "size", setup_queue, run_size, teardown_queue, apply_size, 0},
+    {"delete_mid", "dm", setup_queue, run_delete_mid, teardown_queue,
+     apply_dm, 0},
+    {"swap", "swap", setup_queue, run_swap, teardown_queue, apply_swap, 0},
+    {"reverse", "reverse", setup_queue, run_reverse, teardown_queue,
+     apply_reverse, 0},
+    {"delete_dup", "dedup", setup_queue, run_delete_dup, teardown_queue,
+     apply_dedup, dut_sorted},
+    {"sort", "sort", setup_queue, run_sort, teardown_queue, apply_sort, 0},
+    {"free", "free", setup_queue, run_free, teardown_freed, apply_free,
+     dut_consumes},
+};
+
+const int dut_op_count = sizeof(dut_ops) / sizeof(dut_ops[0]);
+
+int dut_find(const char *name)
+{
+    for (int i = 0; i < dut_op_count; i++) {
+        if (!strcmp(dut_ops[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+int dut_find_command(const char *command)
+{
+    for (int i = 0; i < dut_op_count; i++) {
+        if (!strcmp(dut_ops[i].command, command))
+            return i;
+    }
+    return -1;
+}
+
+const char *dut_commands(void)
+{
+    static char list[128];
+    if (!list[0]) {
+        for (int i = 0; i < dut_op_count; i++) {
+            if (i)
+                strncat(list, " ", sizeof(list) - strlen(list) - 1);
+            strncat(list, dut_ops[i].command, sizeof(list) - strlen(list) - 1);
+        }
+    }
+    return list;
+}
+
+static inline void touch(const void *p)
+{
+    (void) *(const volatile char *) p;
+}
+
+/* Bring queue l, and the string to insert if any, to dudect_cache state */
+static void set_cache_state(void)
+{
+    if (dudect_cache != cache_warm && dudect_cache != cache_flushed)
+        return;
+    void (*apply)(const void *) =
+        dudect_cache == cache_warm ? touch : cache_flush;
+
+    if (l) {
+        struct list_head *li;
+        list_for_each (li, l) {
+            element_t *e = list_entry(li, element_t, list);
+            apply(e->value);
+            apply(e);
+        }
+        apply(l);
+    }
+    if (dut_string)
+        apply(dut_string);
+    if (dudect_cache == cache_flushed)
+        cache_fence();
+}
+
 void measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
-    assert(mode == test_insert_head || mode == test_insert_tail ||
-           mode == test_remove_head || mode == test_remove_tail);
-
-    switch (mode) {
-    case test_insert_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-        break;
-    case test_insert_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
-        break;
-    case test_remove_head:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
-        break;
-    case test_remove_tail:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            if (e)
-                q_release_element(e);
-            dut_free();
-        }
-        break;
-    default:
-        for (size_t i = drop_size; i < n_measure - drop_size; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * chunk_size) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
-        }
+    assert(mode >= 0 && mode < dut_op_count);
+    const dut_op_t *op = &dut_ops[mode];
+    /* Large queues evict these from cache: read them before measuring */
+    void (*run)(void) = op->run;
+    const int backend = timer_backend;
+
+    for (size_t i = drop_size; i < n_measure - drop_size; i++) {
+        op->setup(*(uint16_t *) (input_data + i * chunk_size) % 10000);
+        set_cache_state();
+        before_ticks[i] = timer_start(backend);
+        run();
+        after_ticks[i] = timer_end(backend);
+        op->teardown();
     }
 }
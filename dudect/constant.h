@@ -4,12 +4,6 @@
 #include <stdint.h>
 #define dut_new() ((void) (l = q_new()))
 
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
-
 #define dut_insert_head(s, n)    \
     do {                         \
         int j = n;               \
@@ -26,6 +20,56 @@
 
 #define dut_free() ((void) (q_free(l)))
 
+/* Cache state of the queue at the start of each measurement */
+enum {
+    cache_as_is,   /* As left by building the queue */
+    cache_warm,    /* Every node and string just read */
+    cache_flushed, /* Every node and string evicted */
+};
+
+extern int dudect_cache;
+
+struct list_head;
+
+/* How an operation uses the queue given to apply */
+enum {
+    dut_fills = 1,    /* Inserts, once per element into an empty queue */
+    dut_drains = 2,   /* Removes, once per element of the queue */
+    dut_sorted = 4,   /* Expects the queue sorted */
+    dut_consumes = 8, /* Frees the queue itself */
+};
+
+/*
+ * Queue operation, measured in simulation mode and timed by bench and
+ * complexity.
+ * setup builds the queue l, of a size drawn from the input class, run is
+ * the measured call, and teardown releases everything setup and run left.
+ * apply runs the operation once on a queue built by the caller instead,
+ * with value as the string to insert for operations taking one.
+ */
+typedef struct {
+    const char *name;
+    const char *command; /* Name of the qtest command running it */
+    void (*setup)(uint16_t size);
+    void (*run)(void);
+    void (*teardown)(void);
+    void (*apply)(struct list_head *head, char *value);
+    int flags;
+} dut_op_t;
+
+/* Registry of operations, indexed by the mode argument of measure() */
+extern const dut_op_t dut_ops[];
+extern const int dut_op_count;
+
+/* Index of operation name in dut_ops, or -1 if there is none */
+int dut_find(const char *name);
+
+/* Index of the operation run by qtest command, or -1 if there is none */
+int dut_find_command(const char *command);
+
+/* Space separated qtest commands of all operations in dut_ops */
+const char *dut_commands(void);
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 void measure(int64_t *before_ticks,
@@ -0,0 +1,153 @@
+#include "cpucycles.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/* Number of empty measurements used to calibrate timer overhead */
+#define CALIBRATE_ROUNDS 1000
+
+int dudect_timer = timer_rdtsc;
+int64_t timer_overhead = 0;
+
+int timer_backend = timer_rdtsc;
+
+/* Counter of calling thread and its mapped page, opened on demand */
+static __thread int perf_fd = -1;
+#ifdef __linux__
+static __thread struct perf_event_mmap_page *perf_page = NULL;
+#endif
+
+/* Closes the counter of an exiting thread */
+static pthread_key_t perf_key;
+static pthread_once_t perf_key_once = PTHREAD_ONCE_INIT;
+
+static void perf_close(void *arg)
+{
+    (void) arg;
+#ifdef __linux__
+    if (perf_page)
+        munmap(perf_page, sysconf(_SC_PAGESIZE));
+    perf_page = NULL;
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_fd = -1;
+#endif
+}
+
+static void create_perf_key(void)
+{
+    pthread_key_create(&perf_key, perf_close);
+}
+
+static bool perf_open(void)
+{
+#ifdef __linux__
+    if (perf_fd >= 0)
+        return true;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* Count this thread on any CPU */
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        return false;
+
+    /* Without the page, or without rdpmc allowed, fall back to read() */
+    void *page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                      perf_fd, 0);
+    perf_page = page == MAP_FAILED ? NULL : page;
+
+    pthread_once(&perf_key_once, create_perf_key);
+    /* Any non-NULL value, for perf_close() to run at thread exit */
+    pthread_setspecific(perf_key, &perf_fd);
+
+    ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Read the counter in user space with rdpmc, as described for
+ * perf_event_mmap_page in linux/perf_event.h.  Return false if the kernel
+ * does not allow it now, for instance when the counter is not running.
+ */
+static inline bool perf_rdpmc(int64_t *count)
+{
+#if defined(__linux__) && (defined(__i386__) || defined(__x86_64__))
+    struct perf_event_mmap_page *pc = perf_page;
+    if (!pc)
+        return false;
+
+    uint32_t seq;
+    do {
+        seq = pc->lock;
+        __asm__ volatile("" ::: "memory");
+        uint32_t idx = pc->index;
+        if (!pc->cap_user_rdpmc || !idx)
+            return false;
+
+        unsigned int hi, lo;
+        __asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx - 1));
+        /* Sign extend the pmc_width bits read */
+        int shift = 64 - pc->pmc_width;
+        int64_t pmc = (int64_t) (((uint64_t) hi << 32 | lo) << shift) >> shift;
+        *count = pc->offset + pmc;
+        __asm__ volatile("" ::: "memory");
+    } while (pc->lock != seq);
+    return true;
+#else
+    (void) count;
+    return false;
+#endif
+}
+
+int64_t perf_cycles(void)
+{
+    int64_t count = 0;
+    if (perf_rdpmc(&count))
+        return count;
+    if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+    return count;
+}
+
+bool timer_thread_setup(void)
+{
+    return timer_backend != timer_perf || perf_open();
+}
+
+void timer_setup(void)
+{
+    /* Try the requested backend anew, it may have become available */
+    timer_backend = dudect_timer;
+    if (!timer_thread_setup()) {
+        printf("perf_event_open unavailable, falling back to clock_gettime\n");
+        timer_backend = timer_clock;
+    }
+
+    /* Smallest cost of an empty measurement */
+    int64_t min = INT64_MAX;
+    for (int i = 0; i < CALIBRATE_ROUNDS; i++) {
+        int64_t before = timer_start(timer_backend);
+        int64_t after = timer_end(timer_backend);
+        if (after - before < min)
+            min = after - before;
+    }
+    timer_overhead = min > 0 ? min : 0;
+}
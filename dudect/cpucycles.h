@@ -1,4 +1,48 @@
+#ifndef DUDECT_CPUCYCLES_H
+#define DUDECT_CPUCYCLES_H
+
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+
+/* Measurement backends, selected by dudect_timer */
+enum {
+    timer_rdtsc,  /* Bare cycle counter read */
+    timer_fenced, /* Cycle counter read serialized against measured code */
+    timer_perf,   /* PERF_COUNT_HW_CPU_CYCLES through perf_event_open */
+    timer_clock,  /* clock_gettime, in nanoseconds */
+};
+
+extern int dudect_timer;
+
+/*
+ * Backend in use, set by timer_setup(): dudect_timer, unless that is not
+ * available and timer_clock is used instead.
+ */
+extern int timer_backend;
+
+/* Cost of an empty timer_start()/timer_end() pair, set by timer_setup() */
+extern int64_t timer_overhead;
+
+/*
+ * Prepare selected backend and calibrate its overhead.
+ * Falls back to timer_clock when the backend is not available, leaving
+ * dudect_timer as the user set it.
+ */
+void timer_setup(void);
+
+/*
+ * Prepare backend for calling thread, once timer_setup() has run.
+ * Return false if it is not available to this thread.
+ */
+bool timer_thread_setup(void);
+
+/*
+ * Read cycle counter of perf event opened by timer_setup(), with rdpmc
+ * where the kernel allows it, or else through read().
+ */
+int64_t perf_cycles(void);
+
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
 static inline int64_t cpucycles(void)
 {
@@ -21,3 +65,97 @@ static inline int64_t cpucycles(void)
 #error Unsupported Architecture
 #endif
 }
+
+/*
+ * Read cycle counter once all earlier instructions have completed, and
+ * before any later one starts.
+ */
+static inline int64_t cpucycles_start(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\t" : "=a"(lo), "=d"(hi)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
+    return val;
+#endif
+}
+
+/* Read cycle counter once measured code has completed */
+static inline int64_t cpucycles_end(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)::"ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#endif
+}
+
+/* Evict the cache line holding p from every cache level */
+static inline void cache_flush(const void *p)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile("clflush (%0)" ::"r"(p) : "memory");
+#elif defined(__aarch64__)
+    asm volatile("dc civac, %0" ::"r"(p) : "memory");
+#endif
+}
+
+/* Wait for earlier cache_flush() calls to complete */
+static inline void cache_fence(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ volatile("mfence" ::: "memory");
+#elif defined(__aarch64__)
+    asm volatile("dsb sy" ::: "memory");
+#endif
+}
+
+static inline int64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Read the clock of given backend before and after measured code.
+ * Callers copy timer_backend to a local first: a global read inside the
+ * measured region may miss in cache after a large setup, and only then.
+ */
+static inline int64_t timer_start(int backend)
+{
+    switch (backend) {
+    case timer_fenced:
+        return cpucycles_start();
+    case timer_perf:
+        return perf_cycles();
+    case timer_clock:
+        return clock_ns();
+    default:
+        return cpucycles();
+    }
+}
+
+static inline int64_t timer_end(int backend)
+{
+    switch (backend) {
+    case timer_fenced:
+        return cpucycles_end();
+    case timer_perf:
+        return perf_cycles();
+    case timer_clock:
+        return clock_ns();
+    default:
+        return cpucycles();
+    }
+}
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Raw measurement export.
+ *
+ * Measuring threads fill fixed size chunks of records under a lock, once per
+ * batch and never inside a timed region.  Full chunks are queued to a writer
+ * thread, which does all file I/O, so a slow disk cannot stretch the time
+ * between measurements.  Written chunks go to a free list for reuse.
+ */
+
+#define _GNU_SOURCE
+#include "export.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpucycles.h"
+
+/* Records per chunk handed to the writer thread */
+#define chunk_records 4096
+
+typedef struct CHUNK {
+    struct CHUNK *next;
+    size_t count;
+    export_record_t records[chunk_records];
+} chunk_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+/* State below is guarded by lock */
+static FILE *out = NULL;
+static pthread_t writer;
+static bool stopping = false;
+static chunk_t *current = NULL;
+static chunk_t *pending = NULL, **pending_tail = &pending;
+static chunk_t *spare = NULL;
+static uint32_t test = 0, batch = 0;
+static bool failed = false;
+
+static void *writer_run(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (!pending && !stopping)
+            pthread_cond_wait(&ready, &lock);
+        if (!pending)
+            break;
+
+        chunk_t *c = pending;
+        pending = c->next;
+        if (!pending)
+            pending_tail = &pending;
+
+        /* Write without holding up measuring threads */
+        pthread_mutex_unlock(&lock);
+        bool ok = fwrite(c->records, sizeof(export_record_t), c->count, out) ==
+                  c->count;
+        pthread_mutex_lock(&lock);
+
+        failed |= !ok;
+        c->next = spare;
+        spare = c;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Queue current chunk for writing.  Called with lock held */
+static void hand_over(void)
+{
+    if (!current || !current->count)
+        return;
+    current->next = NULL;
+    *pending_tail = current;
+    pending_tail = &current->next;
+    current = NULL;
+    pthread_cond_signal(&ready);
+}
+
+bool export_open(const char *filename)
+{
+    export_close();
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+        return false;
+
+    export_header_t header = {
+        .magic = EXPORT_MAGIC,
+        .record_size = sizeof(export_record_t),
+    };
+    if (fwrite(&header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return false;
+    }
+
+    pthread_mutex_lock(&lock);
+    out = f;
+    stopping = false;
+    failed = false;
+    test = 0;
+    batch = 0;
+    bool ok = !pthread_create(&writer, NULL, writer_run, NULL);
+    if (!ok)
+        out = NULL;
+    pthread_mutex_unlock(&lock);
+
+    if (!ok)
+        fclose(f);
+    return ok;
+}
+
+void export_close(void)
+{
+    pthread_mutex_lock(&lock);
+    if (!out) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    hand_over();
+    stopping = true;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(writer, NULL);
+
+    pthread_mutex_lock(&lock);
+    if (fclose(out) || failed)
+        fprintf(stderr, "Warning: raw measurements incompletely exported\n");
+    out = NULL;
+    while (spare) {
+        chunk_t *c = spare;
+        spare = c->next;
+        free(c);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+bool export_active(void)
+{
+    pthread_mutex_lock(&lock);
+    bool active = out;
+    pthread_mutex_unlock(&lock);
+    return active;
+}
+
+void export_test(void)
+{
+    pthread_mutex_lock(&lock);
+    if (out && batch) {
+        test++;
+        batch = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void export_batch(int mode,
+                  const int64_t *before_ticks,
+                  const int64_t *after_ticks,
+                  const int64_t *exec_times,
+                  const uint8_t *classes,
+                  size_t n)
+{
+    int cpu = sched_getcpu();
+
+    pthread_mutex_lock(&lock);
+    if (!out) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+
+    uint32_t this_batch = batch++;
+    for (size_t i = 0; i < n; i++) {
+        if (!before_ticks[i] && !after_ticks[i])
+            continue;
+
+        if (!current) {
+            current = spare;
+            if (current)
+                spare = current->next;
+            else if (!(current = malloc(sizeof(chunk_t)))) {
+                failed = true;
+                break;
+            }
+            current->count = 0;
+        }
+
+        current->records[current->count++] = (export_record_t){
+            .ticks = exec_times[i],
+            .test = test,
+            .batch = this_batch,
+            .cpu = cpu < 0 ? 0 : cpu,
+            .mode = mode,
+            .class = classes[i],
+            .timer = timer_backend,
+        };
+        if (current->count == chunk_records)
+            hand_over();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void export_flush(void)
+{
+    pthread_mutex_lock(&lock);
+    if (out)
+        hand_over();
+    pthread_mutex_unlock(&lock);
+}
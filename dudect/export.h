@@ -0,0 +1,61 @@
+#ifndef DUDECT_EXPORT_H
+#define DUDECT_EXPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Export of raw measurements, for offline analysis by
+ * scripts/dudect-stats.py.
+ *
+ * The file starts with an export_header_t, followed by one export_record_t
+ * per measurement, both in host byte order.
+ */
+
+#define EXPORT_MAGIC "dudect\0\2"
+
+typedef struct {
+    char magic[8];        /* EXPORT_MAGIC */
+    uint32_t record_size; /* sizeof(export_record_t) */
+    uint32_t unused;
+} export_header_t;
+
+typedef struct {
+    int64_t ticks;  /* Execution time, as fed to the t-tests */
+    uint32_t test;  /* Number of simulation since the export began */
+    uint32_t batch; /* Number of batch within the simulation */
+    uint32_t cpu;   /* CPU the batch ran on */
+    uint8_t mode;   /* Measured operation, as index in dut_ops */
+    uint8_t class;  /* Input class of Welch's t-test */
+    uint8_t timer;  /* Backend of ticks, as timer_backend */
+    uint8_t unused;
+} export_record_t;
+
+/* Start exporting to filename, stopping any export in progress */
+bool export_open(const char *filename);
+
+/* Write out everything queued so far and stop exporting */
+void export_close(void);
+
+/* Whether an export is in progress */
+bool export_active(void);
+
+/* Begin a new simulation, numbering its batches from 0 */
+void export_test(void);
+
+/*
+ * Queue n measurements of one batch.  Slots never measured, which have
+ * both tick readings zero, are skipped.  Safe to call from several threads.
+ */
+void export_batch(int mode,
+                  const int64_t *before_ticks,
+                  const int64_t *after_ticks,
+                  const int64_t *exec_times,
+                  const uint8_t *classes,
+                  size_t n);
+
+/* Hand partly filled buffers to the writer thread */
+void export_flush(void);
+
+#endif
@@ -26,26 +26,98 @@
  *    variable time.
  */
 
+#define _GNU_SOURCE
 #include "fixture.h"
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../console.h"
 #include "../random.h"
+#include "../report.h"
 #include "constant.h"
+#include "cpucycles.h"
+#include "export.h"
 #include "ttest.h"
 
+/* Measurement buffers come from the system allocator */
+#define INTERNAL 1
+#include "harness.h"
+
 #define enough_measure 10000
 #define test_tries 10
 
 extern const int drop_size;
 extern const size_t chunk_size;
 extern const size_t n_measure;
+/*
+ * Bank of t-tests: one on the raw measurements, one per cropping
+ * percentile, and a second order test.
+ */
+#define number_percentiles 100
+#define number_tests (1 + number_percentiles + 1)
+#define second_order_test (number_tests - 1)
+
+/* Per-class samples needed before the second order test starts */
+#define second_order_warmup (enough_measure / 10)
+
+/* Samples a test needs before it may decide the verdict */
+#define test_min_measure (enough_measure / 10)
+
 static t_ctx *t;
 
+/* Cropping thresholds, computed from a warm-up batch */
+static int64_t percentiles[number_percentiles];
+
+/* Number of measuring threads, 0 for one per online CPU */
+int dudect_threads = 1;
+
+/* Use cropped and second order tests as well as the raw one */
+int dudect_crop = 0;
+
+/* Stop measuring as soon as the sequential test is decided */
+int dudect_sequential = 0;
+
+/* CPU to measure on, -1 to leave it to the scheduler */
+int dudect_cpu = -1;
+
+/* Longest warm-up busy loop in milliseconds, 0 to skip it */
+int dudect_warmup = 0;
+
+/* Warm-up ends once this many windows in a row agree within tolerance */
+#define warmup_windows 3
+#define warmup_tolerance 0.01
+/* Iterations of the dependent chain timed in one window */
+#define warmup_chunk 200000
+
+/*
+ * Samples of one batch share cache and frequency state, so they are not
+ * independent.  The sequential test works on per-batch mean differences
+ * instead, which are: it needs seq_min_batches of them, and decides once
+ * the interval of seq_width standard errors around their mean is clear of
+ * the effect size that the fixed rule would call leaky.
+ */
+#define seq_min_batches 5
+#define seq_width 4
+
+/* Difference of class means of each batch, pushed as class 0 */
+static t_ctx batch_diff;
+
+/* Measuring thread, pinned to one CPU, with private statistics */
+typedef struct {
+    pthread_t thread;
+    bool joinable;
+    int cpu;
+    int mode;
+    int rounds;
+    t_ctx ctx[number_tests];
+} worker_t;
+
 /* threshold values for Welch's t-test */
 enum {
     t_threshold_bananas = 500, /* Test failed with overwhelming probability */
@@ -61,37 +133,144 @@ static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
-    for (size_t i = 0; i < n_measure; i++)
-        exec_times[i] = after_ticks[i] - before_ticks[i];
+    /* Bare cycle counter reads are taken as they are, as they always were */
+    int64_t overhead = timer_backend == timer_rdtsc ? 0 : timer_overhead;
+    for (size_t i = 0; i < n_measure; i++) {
+        int64_t difference = after_ticks[i] - before_ticks[i];
+        /*
+         * Dropped slots and counter overflows stay non-positive, for
+         * update_statistics() to skip.  A real measurement no longer than
+         * the overhead is clamped rather than lost.
+         */
+        if (difference > 0) {
+            difference -= overhead;
+            if (difference < 1)
+                difference = 1;
+        }
+        exec_times[i] = difference;
+    }
+}
+
+static int cmp(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Set cropping thresholds so that test i keeps the fastest
+ * 1 - 0.5^(10 * (i + 1) / number_percentiles) of the measurements.
+ */
+static void prepare_percentiles(int64_t *exec_times)
+{
+    qsort(exec_times, n_measure, sizeof(int64_t), cmp);
+
+    /* Dropped measurements sort first */
+    size_t first = 0;
+    while (first < n_measure && exec_times[first] <= 0)
+        first++;
+    size_t n = n_measure - first;
+    if (!n)
+        return;
+
+    for (size_t i = 0; i < number_percentiles; i++) {
+        double which =
+            1 - pow(0.5, 10 * (double) (i + 1) / number_percentiles);
+        percentiles[i] = exec_times[first + (size_t) (which * n)];
+    }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
 }
 
-static void update_statistics(const int64_t *exec_times, uint8_t *classes)
+static void update_statistics(t_ctx *ctx,
+                              const int64_t *exec_times,
+                              uint8_t *classes)
 {
+    /* Measurements of each class, in x[class * n_measure...] */
+    double *x = malloc(2 * n_measure * sizeof(double));
+    if (!x)
+        die();
+
+    size_t count[2] = {0, 0};
     for (size_t i = 0; i < n_measure; i++) {
         int64_t difference = exec_times[i];
         /* CPU cycle counter overflowed or dropped measurement */
         if (difference <= 0)
             continue;
+        x[classes[i] * n_measure + count[classes[i]]++] = difference;
+    }
 
-        /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+    for (uint8_t class = 0; class < 2 && dudect_crop; class ++) {
+        double *samples = x + class * n_measure;
+
+        /* Thresholds grow, so each cropped test takes a longer prefix */
+        qsort(samples, count[class], sizeof(double), cmp_double);
+        size_t kept = 0;
+        for (size_t crop = 0; crop < number_percentiles; crop++) {
+            while (kept < count[class] && samples[kept] < percentiles[crop])
+                kept++;
+            t_push_batch(&ctx[crop + 1], samples, kept, class);
+        }
     }
+
+    /* do a t-test on the execution time */
+    for (uint8_t class = 0; class < 2; class ++)
+        t_push_batch(&ctx[0], x + class * n_measure, count[class], class);
+
+    /* do a second order test, once the means are well established */
+    for (uint8_t class = 0; class < 2 && dudect_crop; class ++) {
+        if (ctx[0].n[class] <= second_order_warmup)
+            continue;
+        double *samples = x + class * n_measure;
+        for (size_t i = 0; i < count[class]; i++) {
+            double centered = samples[i] - ctx[0].mean[class];
+            samples[i] = centered * centered;
+        }
+        t_push_batch(&ctx[second_order_test], samples, count[class], class);
+    }
+
+    free(x);
 }
 
-static bool report(void)
+/* Test with largest |t| among those with enough measurements */
+static t_ctx *max_test(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
-    double max_tau = max_t / sqrt(number_traces_max_t);
+    size_t ret = 0;
+    double max = 0;
+    for (size_t i = 0; i < number_tests; i++) {
+        if (t[i].n[0] + t[i].n[1] < test_min_measure)
+            continue;
+
+        double x = fabs(t_compute(&t[i]));
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
+    }
+    return &t[ret];
+}
+
+static bool report_test(void)
+{
+    double number_traces = t[0].n[0] + t[0].n[1];
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < enough_measure) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < enough_measure) {
         printf("not enough measurements (%.0f still to go).\n",
-               enough_measure - number_traces_max_t);
+               enough_measure - number_traces);
         return false;
     }
 
+    t_ctx *max = max_test();
+    double max_t = fabs(t_compute(max));
+    double number_traces_max_t = max->n[0] + max->n[1];
+    double max_tau = max_t / sqrt(number_traces_max_t);
+
     /* max_t: the t statistic value
      * max_tau: a t value normalized by sqrt(number of measurements).
      *          this way we can compare max_tau taken with different
@@ -117,7 +296,58 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/*
+ * Sequential test on the batch mean differences, scaled by the pooled
+ * standard deviation of the raw test.  Reaching t_threshold_moderate after
+ * enough_measure measurements takes an effect of 2 * t / sqrt(n).
+ * Early batches run on colder caches and tend to look leakier than the
+ * whole run, so a leak stops early only with overwhelming evidence.
+ * Return 1 when leaky, 0 when constant, and -1 while undecided.
+ */
+static int sequential_verdict(void)
+{
+    double batches = batch_diff.n[0];
+    double n = t[0].n[0] + t[0].n[1];
+    if (batches < seq_min_batches || n < 3)
+        return -1;
+
+    double sigma = sqrt((t[0].m2[0] + t[0].m2[1]) / (n - 2));
+    if (!(sigma > 0))
+        return -1;
+
+    double effect = fabs(batch_diff.mean[0]) / sigma;
+    double error = seq_width *
+                   sqrt(batch_diff.m2[0] / (batches - 1) / batches) / sigma;
+    double limit = 2 * t_threshold_moderate / sqrt(enough_measure);
+    if (effect - error > limit &&
+        fabs(t_compute(max_test())) > t_threshold_bananas)
+        return 1;
+    if (effect + error < limit)
+        return 0;
+    return -1;
+}
+
+/* Push the difference of class means of one batch to batch_diff */
+static void update_batch_diff(const int64_t *exec_times,
+                              const uint8_t *classes)
+{
+    double sum[2] = {0, 0};
+    size_t count[2] = {0, 0};
+    for (size_t i = 0; i < n_measure; i++) {
+        if (exec_times[i] <= 0)
+            continue;
+        sum[classes[i]] += exec_times[i];
+        count[classes[i]]++;
+    }
+    if (count[0] && count[1])
+        t_push(&batch_diff, sum[1] / count[1] - sum[0] / count[0], 0);
+}
+
+/*
+ * Measure one batch of n_measure inputs.
+ * Feed the bank of tests ctx, or set the cropping thresholds if ctx is NULL.
+ */
+static void measure_batch(t_ctx *ctx, int mode)
 {
     int64_t *before_ticks = calloc(n_measure + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(n_measure + 1, sizeof(int64_t));
@@ -134,59 +364,212 @@ static bool doit(int mode)
 
     measure(before_ticks, after_ticks, input_data, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    bool ret = report();
+    if (ctx == t && dudect_sequential)
+        update_batch_diff(exec_times, classes);
+    if (ctx)
+        export_batch(mode, before_ticks, after_ticks, exec_times, classes,
+                     n_measure);
+    if (ctx)
+        update_statistics(ctx, exec_times, classes);
+    else
+        prepare_percentiles(exec_times);
 
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
     free(classes);
     free(input_data);
+}
 
-    return ret;
+static bool doit(int mode)
+{
+    measure_batch(t, mode);
+    return report_test();
 }
 
-static void init_once(void)
+/* Bind calling thread to cpu, returning false if it could not */
+static bool pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return !sched_setaffinity(0, sizeof(set), &set);
+#else
+    return false;
+#endif
+}
+
+/*
+ * Busy loop until the core clock settles after a frequency change.  The
+ * cycle counter runs at a fixed rate on most CPUs, so instead a fixed chain
+ * of dependent additions is timed, which runs faster as the core speeds up.
+ */
+static void warm_up(void)
+{
+    if (dudect_warmup <= 0)
+        return;
+
+    int64_t deadline = clock_ns() + (int64_t) dudect_warmup * 1000000;
+    double last = 0;
+    int stable = 0;
+    while (stable < warmup_windows && clock_ns() < deadline) {
+        int64_t begin = clock_ns();
+        uint64_t x = 0;
+        for (int i = 0; i < warmup_chunk; i++) {
+            x += i;
+            __asm__ volatile("" : "+r"(x));
+        }
+        double elapsed = clock_ns() - begin;
+
+        if (last > 0 && fabs(elapsed - last) < warmup_tolerance * last)
+            stable++;
+        else
+            stable = 0;
+        last = elapsed;
+    }
+}
+
+/* Spread of the raw measurements of each class, to compare noise levels */
+static void report_noise(const char *text)
+{
+    double sd[2];
+    for (int i = 0; i < 2; i++)
+        sd[i] = t[0].n[i] > 1 ? sqrt(t[0].m2[i] / (t[0].n[i] - 1)) : 0;
+    report(3,
+           "%s: class 0 mean %.1f sd %.1f, class 1 mean %.1f sd %.1f, "
+           "%.0f measurements",
+           text, t[0].mean[0], sd[0], t[0].mean[1], sd[1],
+           t[0].n[0] + t[0].n[1]);
+}
+
+static void worker_run(worker_t *w)
+{
+    warm_up();
+    /* Samples of a thread without a counter are all dropped */
+    timer_thread_setup();
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&w->ctx[i]);
+    for (int i = 0; i < w->rounds; i++)
+        measure_batch(w->ctx, w->mode);
+}
+
+/* Return the block cache of the worker before it is joined */
+static void *worker_thread(void *arg)
+{
+    worker_t *w = arg;
+    /* Best effort: an unpinned worker still gives valid samples */
+    pin(w->cpu);
+    worker_run(w);
+    release_thread_cache();
+    return NULL;
+}
+
+/*
+ * Spread rounds of measurement over nthreads workers, then merge their
+ * statistics into t.
+ */
+static bool doit_parallel(int mode, int rounds, int nthreads)
+{
+    worker_t *workers = calloc(nthreads, sizeof(worker_t));
+    if (!workers)
+        die();
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        ncpu = 1;
+    int first = dudect_cpu >= 0 ? dudect_cpu : 0;
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        w->cpu = (first + i) % ncpu;
+        w->mode = mode;
+        w->rounds = rounds / nthreads + (i < rounds % nthreads);
+        w->joinable = !pthread_create(&w->thread, NULL, worker_thread, w);
+        /* Fall back to measuring in this thread, left unpinned */
+        if (!w->joinable)
+            worker_run(w);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        if (workers[i].joinable)
+            pthread_join(workers[i].thread, NULL);
+        for (size_t j = 0; j < number_tests; j++)
+            t_merge(&t[j], &workers[i].ctx[j]);
+    }
+    free(workers);
+
+    return report_test();
+}
+
+static void init_once(int mode)
 {
     init_dut();
-    t_init(t);
+    for (size_t i = 0; i < number_tests; i++)
+        t_init(&t[i]);
+    t_init(&batch_diff);
+    export_test();
+    /* Warm-up batch only sets the cropping thresholds */
+    if (dudect_crop)
+        measure_batch(NULL, mode);
 }
 
 static bool TEST_CONST(char *text, int mode)
 {
     bool result = false;
-    t = malloc(sizeof(t_ctx));
+    t = malloc(number_tests * sizeof(t_ctx));
+    timer_setup();
+
+    int rounds = enough_measure / (n_measure - drop_size * 2) + 1;
+    int nthreads = dudect_threads;
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+#ifdef __linux__
+    /* Measuring threads pin themselves; otherwise pin this one for a while */
+    cpu_set_t saved;
+    bool pinned = nthreads <= 1 && dudect_cpu >= 0 &&
+                  !sched_getaffinity(0, sizeof(saved), &saved) &&
+                  pin(dudect_cpu);
+#endif
+    if (nthreads <= 1)
+        warm_up();
 
     for (int cnt = 0; cnt < test_tries; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, test_tries);
-        init_once();
-        for (int i = 0; i < enough_measure / (n_measure - drop_size * 2) + 1;
-             ++i)
-            result = doit(mode);
+        init_once(mode);
+        if (nthreads > 1) {
+            result = doit_parallel(mode, rounds, nthreads);
+        } else {
+            for (int i = 0; i < rounds; ++i) {
+                result = doit(mode);
+                if (!dudect_sequential)
+                    continue;
+
+                /* rounds caps the measurements if still undecided */
+                int verdict = sequential_verdict();
+                if (verdict >= 0) {
+                    result = !verdict;
+                    break;
+                }
+            }
+        }
         printf("\033[A\033[2K\033[A\033[2K");
+        export_flush();
+        report_noise(text);
         if (result == true)
             break;
     }
+#ifdef __linux__
+    if (pinned)
+        sched_setaffinity(0, sizeof(saved), &saved);
+#endif
     free(t);
     return result;
 }
 
-bool is_insert_head_const(void)
-{
-    return TEST_CONST("insert_head", 0);
-}
-
-bool is_insert_tail_const(void)
-{
-    return TEST_CONST("insert_tail", 1);
-}
-
-bool is_remove_head_const(void)
-{
-    return TEST_CONST("remove_head", 2);
-}
-
-bool is_remove_tail_const(void)
+bool is_const(const char *name)
 {
-    return TEST_CONST("remove_tail", 3);
+    int mode = dut_find(name);
+    assert(mode >= 0);
+    return TEST_CONST((char *) name, mode);
 }
@@ -4,10 +4,38 @@
 #include <stdbool.h>
 #include "constant.h"
 
-/* Interface to test if function is constant */
-bool is_insert_head_const(void);
-bool is_insert_tail_const(void);
-bool is_remove_head_const(void);
-bool is_remove_tail_const(void);
+/* Number of measuring threads, 0 for one per online CPU */
+extern int dudect_threads;
+
+/*
+ * Nonzero to also run t-tests on measurements cropped at several
+ * percentiles and a second order test, failing on the largest |t|.
+ */
+extern int dudect_crop;
+
+/*
+ * Nonzero to stop measuring once a sequential test on batch means decides
+ * between "constant" and "leaky", instead of always taking the full number
+ * of measurements.  Applies to serial measurement only.
+ */
+extern int dudect_sequential;
+
+/*
+ * CPU to pin measurement to, or -1 not to pin.  Measuring threads of
+ * dudect_threads take the CPUs following it.
+ */
+extern int dudect_cpu;
+
+/*
+ * Nonzero to busy loop for up to this many milliseconds before measuring,
+ * until the core clock stops ramping up.
+ */
+extern int dudect_warmup;
+
+/*
+ * Interface to test if function is constant.
+ * name is one of the operations registered in dut_ops.
+ */
+bool is_const(const char *name);
 
 #endif
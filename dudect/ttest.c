@@ -15,6 +15,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* Samples summarized before each merge, few enough to stay in L1 cache */
+#define t_chunk 256
+
+/* Independent accumulators of a sum, as wide as AVX on doubles */
+#define t_lanes 4
+
 void t_push(t_ctx *ctx, double x, uint8_t class)
 {
     assert(class == 0 || class == 1);
@@ -28,6 +34,86 @@ void t_push(t_ctx *ctx, double x, uint8_t class)
     ctx->m2[class] = ctx->m2[class] + delta * (x - ctx->mean[class]);
 }
 
+/*
+ * Merge count samples of given mean and M2 into class of ctx, as in
+ * Chan et al.'s parallel algorithm.
+ */
+static void merge(t_ctx *ctx,
+                  uint8_t class,
+                  double count,
+                  double mean,
+                  double m2)
+{
+    double n = ctx->n[class] + count;
+    if (n == 0)
+        return;
+
+    double delta = mean - ctx->mean[class];
+    ctx->mean[class] += delta * count / n;
+    ctx->m2[class] += m2 + delta * delta * ctx->n[class] * count / n;
+    ctx->n[class] = n;
+}
+
+/* Merge statistics of src into dst */
+void t_merge(t_ctx *dst, const t_ctx *src)
+{
+    for (int class = 0; class < 2; class ++)
+        merge(dst, class, src->n[class], src->mean[class], src->m2[class]);
+}
+
+/* Sum of x[0..n), over t_lanes independent accumulators */
+static double sum(const double *x, size_t n)
+{
+    double lane[t_lanes] = {0};
+    size_t i = 0;
+    for (; i + t_lanes <= n; i += t_lanes) {
+        for (size_t k = 0; k < t_lanes; k++)
+            lane[k] += x[i + k];
+    }
+    for (; i < n; i++)
+        lane[0] += x[i];
+
+    double total = 0;
+    for (size_t k = 0; k < t_lanes; k++)
+        total += lane[k];
+    return total;
+}
+
+/* Sum of (x[i] - mean)^2 over x[0..n), as sum() */
+static double sum_squares(const double *x, size_t n, double mean)
+{
+    double lane[t_lanes] = {0};
+    size_t i = 0;
+    for (; i + t_lanes <= n; i += t_lanes) {
+        for (size_t k = 0; k < t_lanes; k++) {
+            double d = x[i + k] - mean;
+            lane[k] += d * d;
+        }
+    }
+    for (; i < n; i++)
+        lane[0] += (x[i] - mean) * (x[i] - mean);
+
+    double total = 0;
+    for (size_t k = 0; k < t_lanes; k++)
+        total += lane[k];
+    return total;
+}
+
+/*
+ * Each chunk is summarized in two passes, which keeps M2 accurate without
+ * a division per sample, then merged into ctx.  Independent accumulators
+ * let the compiler vectorize the passes without reassociating additions.
+ */
+void t_push_batch(t_ctx *ctx, const double *x, size_t n, uint8_t class)
+{
+    assert(class == 0 || class == 1);
+    for (size_t start = 0; start < n; start += t_chunk) {
+        size_t len = n - start < t_chunk ? n - start : t_chunk;
+        double mean = sum(x + start, len) / len;
+        merge(ctx, class, len, mean, sum_squares(x + start, len, mean));
+    }
+}
+
 double t_compute(t_ctx *ctx)
 {
     double var[2] = {0.0, 0.0};
@@ -1,6 +1,7 @@
 #ifndef DUDECT_TTEST_H
 #define DUDECT_TTEST_H
 
+#include <stddef.h>
 #include <stdint.h>
 typedef struct {
     double mean[2];
@@ -9,6 +10,10 @@ typedef struct {
 } t_ctx;
 
 void t_push(t_ctx *ctx, double x, uint8_t class);
+/* Push n samples x of one class at once */
+void t_push_batch(t_ctx *ctx, const double *x, size_t n, uint8_t class);
+/* Merge statistics of src into dst, as if its samples were pushed to dst */
+void t_merge(t_ctx *dst, const t_ctx *src);
 double t_compute(t_ctx *ctx);
 void t_init(t_ctx *ctx);
 
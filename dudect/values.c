@@ -0,0 +1,19 @@
+#include "values.h"
+#include <stdint.h>
+#include "../random.h"
+
+void random_values(value_t *values, size_t n)
+{
+    randombytes((uint8_t *) values, n * value_size);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < value_size - 1; j++)
+            values[i][j] = 'a' + (uint8_t) values[i][j] % 26;
+        values[i][value_size - 1] = 0;
+    }
+}
+
+int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,17 @@
+#ifndef DUDECT_VALUES_H
+#define DUDECT_VALUES_H
+
+#include <stddef.h>
+
+/* Strings inserted into timed queues, of value_size - 1 lowercase letters */
+#define value_size 8
+
+typedef char value_t[value_size];
+
+/* Fill values with n random strings */
+void random_values(value_t *values, size_t n);
+
+/* qsort() comparison of int64_t, such as measured times */
+int cmp_int64(const void *a, const void *b);
+
+#endif
@@ -1,12 +1,18 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -35,24 +41,102 @@
  */
 typedef struct BELE {
     struct BELE *next, *prev;
+    _Atomic(struct TCACHE *) owner; /* Thread cache holding this block */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    /* Aligned as malloc would, which pads the header to 48 bytes */
+    _Alignas(16) unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_ele_t;
 
-static block_ele_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* find_header() and find_footer() take the payload to follow the header */
+_Static_assert(sizeof(block_ele_t) == offsetof(block_ele_t, payload) &&
+                   sizeof(block_ele_t) % 16 == 0,
+               "payload must end the header and be 16-byte aligned");
+
+/*
+ * Each thread keeps its own list of allocated blocks, so that threads
+ * allocating concurrently never touch a shared list.  The lock is only
+ * contended when a block is freed by a thread other than its allocator,
+ * or while allocation_check() and cautious mode walk a list.
+ */
+typedef struct TCACHE {
+    pthread_mutex_t lock;
+    block_ele_t *allocated;
+    size_t allocated_count;
+    struct TCACHE *next; /* Next cache in registry or spare list */
+} tcache_t;
+
+static __thread tcache_t *self_cache = NULL;
+
+/* Runs release_cache() when a thread holding a cache exits */
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/* Blocks still allocated by threads that have exited */
+static tcache_t orphans = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/*
+ * Registry of the caches of live threads, and orphans.  Caches of exited
+ * threads move to the spare list for reuse, and are never freed, so that
+ * the owner of a block can always be locked.
+ */
+static tcache_t *caches = &orphans;
+static tcache_t *spare_caches = NULL;
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * In compact mode, a block is only its payload followed by a 32-bit
+ * canary.  Its size lives in a dense side table holding one slot per
+ * 16-byte granule of address space, found through a three-level radix
+ * tree over the address.  A slot holds the payload size plus one, or
+ * zero when no compact block starts in that granule.  Consecutive
+ * blocks thus have consecutive slots.
+ */
+#define GRANULE_SHIFT 4
+#define LEAF_BITS 16
+#define MID_BITS 14
+#define TOP_BITS (48 - GRANULE_SHIFT - LEAF_BITS - MID_BITS)
+#define COMPACT_MAX_SIZE (UINT32_MAX - 1)
+
+typedef _Atomic(uint32_t) side_slot_t;
+
+typedef struct {
+    _Atomic(side_slot_t *) leaf[1 << MID_BITS];
+} side_mid_t;
+
+static _Atomic(side_mid_t *) side_top[1 << TOP_BITS];
+static atomic_size_t side_count = 0;
+static pthread_mutex_t side_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int compact_mode = 0;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Fault injection schedule, see harness.h */
+int fail_seed = 1;
+int fail_every = 0;
+int fail_first = 0;
+int fail_last = 0;
+int fail_min_size = 0;
+
+/* Number of allocations attempted since last fault_reset() */
+static atomic_size_t alloc_index = 0;
+
+/* Generator deciding random failures */
+static xoshiro_t fail_state;
+static pthread_mutex_t fail_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
+static atomic_bool error_occurred = false;
 static char *error_message = "";
 
-static int time_limit = 1;
+/* Time limit of risky operations in milliseconds */
+int time_limit = 1000;
 
 /*
  * Data for managing exceptions
@@ -61,15 +145,65 @@ static jmp_buf env;
 static volatile sig_atomic_t jmp_ready = false;
 static bool time_limited = false;
 
+/* One-shot CLOCK_MONOTONIC timer delivering SIGALRM */
+static timer_t timer;
+static bool timer_ready = false;
+
 /*
  * Internal functions
  */
 
-/* Should this allocation fail? */
-static bool fail_allocation()
+static uint64_t fail_random()
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    pthread_mutex_lock(&fail_lock);
+    uint64_t result = xoshiro_next(&fail_state);
+    pthread_mutex_unlock(&fail_lock);
+    return result;
+}
+
+void fault_reset()
+{
+    xoshiro_seed(&fail_state, (uint64_t) fail_seed);
+    atomic_store(&alloc_index, 0);
+}
+
+/*
+ * Should this allocation fail?
+ * Number of this allocation is stored at index.
+ */
+static bool fail_allocation(size_t size, size_t *index)
+{
+    size_t n = *index =
+        atomic_fetch_add_explicit(&alloc_index, 1, memory_order_relaxed) + 1;
+    if (!fail_probability && !fail_every && !fail_first)
+        return false;
+
+    if (fail_min_size > 0 && size <= (size_t) fail_min_size)
+        return false;
+
+    if (fail_every > 0 && n % fail_every == 0)
+        return true;
+    if (fail_first > 0 && n >= fail_first &&
+        n <= (fail_last > fail_first ? fail_last : fail_first))
+        return true;
+    return fail_probability > 0 &&
+           fail_random() % 100 < (uint64_t) fail_probability;
+}
+
+/*
+ * Lock the cache owning block b.  Its owner changes only when a thread
+ * exits and hands the block over to orphans, so check it again once
+ * locked.  Caches are never freed, hence a stale one is safe to lock.
+ */
+static tcache_t *lock_owner(block_ele_t *b)
+{
+    for (;;) {
+        tcache_t *tc = b->owner;
+        pthread_mutex_lock(&tc->lock);
+        if (tc == b->owner)
+            return tc;
+        pthread_mutex_unlock(&tc->lock);
+    }
 }
 
 /*
@@ -84,14 +218,17 @@ static block_ele_t *find_header(void *p)
     }
 
     block_ele_t *b = (block_ele_t *) ((size_t) p - sizeof(block_ele_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_ele_t *ab = allocated;
+    /* Owner of a block without a valid header cannot be trusted */
+    if (cautious_mode && b->magic_header == MAGICHEADER) {
+        /* Make sure this is really an allocated block of its cache */
         bool found = false;
+        tcache_t *tc = lock_owner(b);
+        block_ele_t *ab = tc->allocated;
         while (ab && !found) {
             found = ab == b;
             ab = ab->next;
         }
+        pthread_mutex_unlock(&tc->lock);
         if (!found) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
@@ -111,6 +248,273 @@ static block_ele_t *find_header(void *p)
     return b;
 }
 
+/*
+ * Multiply two sizes, as reallocarray does.
+ * Return false if the product would overflow size_t.
+ */
+static bool size_mul(size_t nelem, size_t elsize, size_t *product)
+{
+    if (elsize && nelem > SIZE_MAX / elsize)
+        return false;
+    *product = nelem * elsize;
+    return true;
+}
+
+/*
+ * Size of a regular block holding a payload of size bytes.
+ * Return false if it would overflow size_t.
+ */
+static bool block_size(size_t size, size_t *total)
+{
+    if (size > SIZE_MAX - sizeof(block_ele_t) - sizeof(size_t))
+        return false;
+    *total = size + sizeof(block_ele_t) + sizeof(size_t);
+    return true;
+}
+
+/*
+ * Side table slot of payload p.
+ * Missing levels of the tree are created when create is set; otherwise,
+ * and when allocation fails, return NULL.
+ */
+static side_slot_t *side_slot(const void *p, bool create)
+{
+    uintptr_t g = (uintptr_t) p >> GRANULE_SHIFT;
+    if ((uintptr_t) p & ((1 << GRANULE_SHIFT) - 1) ||
+        g >> (TOP_BITS + MID_BITS + LEAF_BITS))
+        return NULL;
+
+    size_t ti = g >> (MID_BITS + LEAF_BITS);
+    size_t mi = (g >> LEAF_BITS) & ((1 << MID_BITS) - 1);
+    size_t li = g & ((1 << LEAF_BITS) - 1);
+
+    side_mid_t *mid = atomic_load_explicit(&side_top[ti], memory_order_acquire);
+    side_slot_t *leaf =
+        mid ? atomic_load_explicit(&mid->leaf[mi], memory_order_acquire) : NULL;
+    if (!leaf) {
+        if (!create)
+            return NULL;
+
+        pthread_mutex_lock(&side_lock);
+        mid = side_top[ti];
+        if (!mid) {
+            mid = calloc(1, sizeof(side_mid_t));
+            side_top[ti] = mid;
+        }
+        leaf = mid ? mid->leaf[mi] : NULL;
+        if (mid && !leaf) {
+            leaf = calloc(1 << LEAF_BITS, sizeof(side_slot_t));
+            mid->leaf[mi] = leaf;
+        }
+        pthread_mutex_unlock(&side_lock);
+        if (!leaf)
+            return NULL;
+    }
+    return &leaf[li];
+}
+
+/* Size of compact block p stored at size.  Return false if p is not one */
+static bool side_lookup(const void *p, size_t *size)
+{
+    if (!side_count)
+        return false;
+
+    side_slot_t *slot = side_slot(p, false);
+    uint32_t v = slot ? atomic_load_explicit(slot, memory_order_relaxed) : 0;
+    if (!v)
+        return false;
+
+    *size = v - 1;
+    return true;
+}
+
+static void set_canary(void *p, size_t size)
+{
+    uint32_t canary = MAGICFOOTER;
+    memcpy((unsigned char *) p + size, &canary, sizeof(canary));
+}
+
+static bool check_canary(void *p, size_t size)
+{
+    uint32_t canary;
+    memcpy(&canary, (unsigned char *) p + size, sizeof(canary));
+    return canary == MAGICFOOTER;
+}
+
+/*
+ * Allocate compact block, storing it at result.
+ * Return false if size or address does not fit in the side table, in which
+ * case the caller falls back to a regular block.
+ */
+static bool compact_malloc(size_t size, void **result)
+{
+    if (size > COMPACT_MAX_SIZE)
+        return false;
+
+    void *p = malloc(size + sizeof(uint32_t));
+    if (!p) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        *result = NULL;
+        return true;
+    }
+
+    side_slot_t *slot = side_slot(p, true);
+    if (!slot) {
+        free(p);
+        return false;
+    }
+
+    memset(p, FILLCHAR, size);
+    set_canary(p, size);
+    atomic_store_explicit(slot, (uint32_t) size + 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&side_count, 1, memory_order_relaxed);
+
+    *result = p;
+    return true;
+}
+
+/* Free p if it is a compact block.  Return false if it is not */
+static bool compact_free(void *p)
+{
+    size_t size;
+    if (!side_lookup(p, &size))
+        return false;
+
+    if (!check_canary(p, size)) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+    memset(p, FILLCHAR, size + sizeof(uint32_t));
+
+    atomic_store_explicit(side_slot(p, false), 0, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&side_count, 1, memory_order_relaxed);
+    free(p);
+    return true;
+}
+
+/*
+ * Resize p if it is a compact block, storing the result at result.
+ * Compact blocks are always moved, since the side table cannot tell
+ * whether growing in place succeeded.
+ * Return false if p is not a compact block.
+ */
+static bool compact_realloc(void *p, size_t new_size, void **result)
+{
+    size_t old_size;
+    if (!side_lookup(p, &old_size))
+        return false;
+
+    if (!check_canary(p, old_size)) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to realloc it",
+                     p);
+        error_occurred = true;
+    }
+
+    void *np = test_malloc(new_size);
+    if (np) {
+        memcpy(np, p, old_size < new_size ? old_size : new_size);
+        compact_free(p);
+    }
+    *result = np;
+    return true;
+}
+
+/*
+ * Unregister the cache of an exiting thread, handing its blocks over to
+ * orphans, and keep it for reuse by a later thread.
+ */
+static void release_cache(void *arg)
+{
+    tcache_t *tc = arg;
+
+    pthread_mutex_lock(&caches_lock);
+    tcache_t **pp = &caches;
+    while (*pp != tc)
+        pp = &(*pp)->next;
+    *pp = tc->next;
+    pthread_mutex_unlock(&caches_lock);
+
+    pthread_mutex_lock(&tc->lock);
+    if (tc->allocated) {
+        pthread_mutex_lock(&orphans.lock);
+        block_ele_t *last = NULL;
+        for (block_ele_t *b = tc->allocated; b; b = b->next) {
+            b->owner = &orphans;
+            last = b;
+        }
+        last->next = orphans.allocated;
+        if (orphans.allocated)
+            orphans.allocated->prev = last;
+        orphans.allocated = tc->allocated;
+        orphans.allocated_count += tc->allocated_count;
+        pthread_mutex_unlock(&orphans.lock);
+        tc->allocated = NULL;
+        tc->allocated_count = 0;
+    }
+    pthread_mutex_unlock(&tc->lock);
+
+    pthread_mutex_lock(&caches_lock);
+    tc->next = spare_caches;
+    spare_caches = tc;
+    pthread_mutex_unlock(&caches_lock);
+
+    self_cache = NULL;
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&cache_key, release_cache);
+}
+
+/* Cache of calling thread, registered on first use */
+static tcache_t *get_cache()
+{
+    if (self_cache)
+        return self_cache;
+
+    pthread_once(&cache_key_once, create_cache_key);
+    pthread_mutex_lock(&caches_lock);
+    tcache_t *tc = spare_caches;
+    if (tc)
+        spare_caches = tc->next;
+    pthread_mutex_unlock(&caches_lock);
+
+    if (!tc) {
+        tc = malloc(sizeof(tcache_t));
+        if (!tc) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        pthread_mutex_init(&tc->lock, NULL);
+        tc->allocated = NULL;
+        tc->allocated_count = 0;
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    tc->next = caches;
+    caches = tc;
+    pthread_mutex_unlock(&caches_lock);
+
+    self_cache = tc;
+    pthread_setspecific(cache_key, tc);
+    return tc;
+}
+
+void release_thread_cache()
+{
+    if (!self_cache)
+        return;
+    pthread_setspecific(cache_key, NULL);
+    release_cache(self_cache);
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_ele_t *b)
 {
@@ -129,14 +533,27 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
-        report_event(MSG_WARN, "Malloc returning NULL");
+    size_t index;
+    if (fail_allocation(size, &index)) {
+        report_event(MSG_WARN,
+                     "Malloc returning NULL (allocation #%zu, %zu bytes)",
+                     index, size);
         return NULL;
     }
 
-    block_ele_t *new_block =
-        malloc(size + sizeof(block_ele_t) + sizeof(size_t));
-    if (!new_block) {
+    void *compact_p;
+    if (compact_mode && compact_malloc(size, &compact_p))
+        return compact_p;
+
+    size_t total;
+    if (!block_size(size, &total)) {
+        report_event(MSG_WARN, "Malloc size overflow (%zu bytes)", size);
+        return NULL;
+    }
+
+    tcache_t *tc = get_cache();
+    block_ele_t *new_block = malloc(total);
+    if (!tc || !new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
     }
@@ -149,14 +566,17 @@ void *test_malloc(size_t size)
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->owner = tc;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    pthread_mutex_lock(&tc->lock);
+    new_block->next = tc->allocated;
+    if (tc->allocated)
+        tc->allocated->prev = new_block;
+    tc->allocated = new_block;
+    tc->allocated_count++;
+    pthread_mutex_unlock(&tc->lock);
 
     return p;
 }
@@ -167,8 +587,17 @@ void *test_calloc(size_t nelem, size_t elsize)
     /* Reference: Malloc tutorial
      * https://danluu.com/malloc-tutorial/
      */
-    size_t size = nelem * elsize;  // TODO: check for overflow
+    size_t size;
+    if (!size_mul(nelem, elsize, &size)) {
+        report_event(MSG_WARN, "Calloc size overflow (%zu * %zu)", nelem,
+                     elsize);
+        return NULL;
+    }
+
     void *ptr = test_malloc(size);
+    if (!ptr)
+        return NULL;
+
     memset(ptr, 0, size);
     return ptr;
 }
@@ -183,6 +612,9 @@ void test_free(void *p)
     if (!p)
         return;
 
+    if (compact_free(p))
+        return;
+
     block_ele_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -196,18 +628,104 @@ void test_free(void *p)
     *find_footer(b) = MAGICFREE;
     memset(p, FILLCHAR, b->payload_size);
 
-    /* Unlink from list */
+    /* Unlink from list of owning thread */
+    tcache_t *tc = lock_owner(b);
     block_ele_t *bn = b->next;
     block_ele_t *bp = b->prev;
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        tc->allocated = bn;
     if (bn)
         bn->prev = bp;
+    tc->allocated_count--;
+    pthread_mutex_unlock(&tc->lock);
 
     free(b);
-    allocated_count--;
+}
+
+/*
+ * Resize block, keeping its contents up to the smaller of the two sizes.
+ * The underlying block is grown in place whenever the system allocator
+ * allows it; otherwise it moves and its neighbours in the allocated list
+ * are relinked.  On failure, the original block is left untouched.
+ */
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t new_size)
+{
+    if (!p)
+        return test_malloc(new_size);
+
+    if (!new_size) {
+        test_free(p);
+        return NULL;
+    }
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    void *compact_p;
+    if (compact_realloc(p, new_size, &compact_p))
+        return compact_p;
+
+    block_ele_t *b = find_header(p);
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to realloc it",
+                     p);
+        error_occurred = true;
+    }
+
+    size_t index;
+    if (fail_allocation(new_size, &index)) {
+        report_event(MSG_WARN,
+                     "Realloc returning NULL (allocation #%zu, %zu bytes)",
+                     index, new_size);
+        return NULL;
+    }
+
+    size_t total;
+    if (!block_size(new_size, &total)) {
+        report_event(MSG_WARN, "Realloc size overflow (%zu bytes)", new_size);
+        return NULL;
+    }
+
+    /*
+     * A shrunk block is not filled beforehand: should realloc fail, the
+     * caller keeps the block with its contents intact.
+     */
+    size_t old_size = b->payload_size;
+
+    /* Neighbours must not move while this block is relocated */
+    tcache_t *tc = lock_owner(b);
+    block_ele_t *new_block = realloc(b, total);
+    if (!new_block) {
+        pthread_mutex_unlock(&tc->lock);
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+
+    /* Block moved: neighbours still point at the old address */
+    if (new_block != b) {
+        if (new_block->prev)
+            new_block->prev->next = new_block;
+        else
+            tc->allocated = new_block;
+        if (new_block->next)
+            new_block->next->prev = new_block;
+    }
+    pthread_mutex_unlock(&tc->lock);
+
+    new_block->payload_size = new_size;
+    if (new_size > old_size)
+        memset(new_block->payload + old_size, FILLCHAR, new_size - old_size);
+    *find_footer(new_block) = MAGICFOOTER;
+
+    return (void *) &new_block->payload;
 }
 
 // cppcheck-suppress unusedFunction
@@ -223,7 +741,20 @@ char *test_strdup(const char *s)
 
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    pthread_mutex_lock(&caches_lock);
+    for (tcache_t *tc = caches; tc; tc = tc->next) {
+        pthread_mutex_lock(&tc->lock);
+        count += tc->allocated_count;
+        pthread_mutex_unlock(&tc->lock);
+    }
+    pthread_mutex_unlock(&caches_lock);
+    return count + side_count;
+}
+
+size_t allocation_attempts()
+{
+    return atomic_load(&alloc_index);
 }
 
 /*
@@ -253,9 +784,28 @@ void set_noallocate_mode(bool noallocate)
  */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
+}
+
+/* Arm timer to expire after ms milliseconds.  Zero disarms it */
+static void set_timer(int ms)
+{
+    if (!timer_ready) {
+        struct sigevent sev = {
+            .sigev_notify = SIGEV_SIGNAL,
+            .sigev_signo = SIGALRM,
+        };
+        if (timer_create(CLOCK_MONOTONIC, &sev, &timer)) {
+            report_event(MSG_WARN, "Could not create timer for time limit");
+            return;
+        }
+        timer_ready = true;
+    }
+
+    struct itimerspec its = {
+        .it_value = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L},
+    };
+    timer_settime(timer, 0, &its, NULL);
 }
 
 /*
@@ -268,7 +818,7 @@ bool exception_setup(bool limit_time)
         /* Got here from longjmp */
         jmp_ready = false;
         if (time_limited) {
-            alarm(0);
+            set_timer(0);
             time_limited = false;
         }
 
@@ -280,8 +830,8 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
-        alarm(time_limit);
+    if (limit_time && time_limit > 0) {
+        set_timer(time_limit);
         time_limited = true;
     }
     return true;
@@ -293,7 +843,7 @@ bool exception_setup(bool limit_time)
 void exception_cancel()
 {
     if (time_limited) {
-        alarm(0);
+        set_timer(0);
         time_limited = false;
     }
 
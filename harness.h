@@ -15,16 +15,59 @@ void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t new_size);
 
 #ifdef INTERNAL
 
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Report number of allocations attempted since last fault_reset() */
+size_t allocation_attempts();
+
+/*
+ * Hand the block list of the calling thread over for reuse by a later
+ * thread, as is done anyway when the thread exits.  Blocks it still holds
+ * stay counted by allocation_check().
+ */
+void release_thread_cache();
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/*
+ * Deterministic fault injection schedule.
+ * Allocations are numbered from 1 since the last call to fault_reset().
+ *   fail_seed      Seed of the generator behind fail_probability
+ *   fail_every     Fail every Nth allocation (0 disables)
+ *   fail_first     First allocation number of a failing range (0 disables)
+ *   fail_last      Last allocation number of a failing range.  If unset or
+ *                  below fail_first, only allocation fail_first fails
+ *   fail_min_size  Only allocations larger than this many bytes may fail
+ */
+extern int fail_seed;
+extern int fail_every;
+extern int fail_first;
+extern int fail_last;
+extern int fail_min_size;
+
+/* Reseed generator from fail_seed and restart allocation numbering */
+void fault_reset();
+
+/*
+ * Time limit of each risky operation, in milliseconds.
+ * Zero disables the limit.
+ */
+extern int time_limit;
+
+/*
+ * Compact metadata mode.
+ * When nonzero, new blocks carry only a 4-byte canary after the payload,
+ * and their size is kept in a separate side table indexed by address.
+ * Blocks allocated in either mode may be freed at any time.
+ */
+extern int compact_mode;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -63,6 +106,7 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -2,8 +2,10 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +14,10 @@
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+#include "dudect/bench.h"
+#include "dudect/complexity.h"
+#include "dudect/cpucycles.h"
+#include "dudect/export.h"
 #include "dudect/fixture.h"
 #include "list.h"
 
@@ -37,6 +43,7 @@
 #include "queue.h"
 
 #include "console.h"
+#include "random.h"
 #include "report.h"
 
 /* Settable parameters */
@@ -73,13 +80,33 @@ static int fail_count = 0;
 static int string_length = MAXSTRING;
 
 static int listsort = 0;
+
+/* Shuffle relinks nodes, rather than moving values between them */
+static int shuffle_nodes = 0;
+
+/* Print bench results as CSV rather than a table */
+static int bench_csv = 0;
 bool noise = true;
 
 
 
+/* Default lengths of random strings, and the longest allowed */
 #define MIN_RANDSTR_LEN 5
-#define MAX_RANDSTR_LEN 10
-static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
+#define MAX_RANDSTR_LEN 9
+#define RANDSTR_LIMIT 64
+
+/* Random strings generated at a time */
+#define RANDSTR_BATCH 256
+
+/* Random strings use the first rand_alphabet characters */
+static const char charset[] =
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+static int rand_alphabet = 26;
+static int rand_min_len = MIN_RANDSTR_LEN;
+static int rand_max_len = MAX_RANDSTR_LEN;
+
+/* Seed of random strings, shuffles and scripts, 0 for a new one every run */
+static int rand_seed = 0;
 
 /* Forward declarations */
 static bool show_queue(int vlevel);
@@ -143,41 +170,89 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/*
- * TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
- */
-static void fill_rand_string(char *buf, size_t buf_size)
+/* Random strings for insertions, generated RANDSTR_BATCH at a time */
+static struct {
+    char buf[RANDSTR_BATCH * (RANDSTR_LIMIT + 1)];
+    char *strs[RANDSTR_BATCH];
+    int next, count;
+} randstrs;
+
+static char *next_rand_string(void)
+{
+    if (randstrs.next == randstrs.count) {
+        randstr_fill(randstrs.buf, randstrs.strs, RANDSTR_BATCH, rand_min_len,
+                     rand_max_len, charset, rand_alphabet);
+        randstrs.next = 0;
+        randstrs.count = RANDSTR_BATCH;
+    }
+    return randstrs.strs[randstrs.next++];
+}
+
+/* Drop strings generated before random string parameters changed */
+static bool randstr_params_ok(void)
+{
+    randstrs.next = randstrs.count = 0;
+    if (rand_min_len < 1 || rand_min_len > rand_max_len ||
+        rand_max_len > RANDSTR_LIMIT) {
+        report(1, "Random string lengths must satisfy 1 <= %d <= %d <= %d",
+               rand_min_len, rand_max_len, RANDSTR_LIMIT);
+        return false;
+    }
+    if (rand_alphabet < 1 || rand_alphabet > (int) sizeof(charset) - 1) {
+        report(1, "Random string alphabet must have 1 to %d characters",
+               (int) sizeof(charset) - 1);
+        return false;
+    }
+    return true;
+}
+
+static void rand_min_len_setter(int oldval)
+{
+    if (!randstr_params_ok())
+        rand_min_len = oldval;
+}
+
+static void rand_max_len_setter(int oldval)
+{
+    if (!randstr_params_ok())
+        rand_max_len = oldval;
+}
+
+static void rand_alphabet_setter(int oldval)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    if (!randstr_params_ok())
+        rand_alphabet = oldval;
+}
 
-    for (size_t n = 0; n < len; n++) {
-        buf[n] = charset[rand() % (sizeof charset - 1)];
+static void rand_seed_setter(int oldval)
+{
+    randstrs.next = randstrs.count = 0;
+    random_seed((unsigned int) rand_seed);
+}
+
+/* Test if operation name, registered in dut_ops, runs in constant time */
+static bool simulate(int argc, char *argv[], const char *name)
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
     }
-    buf[len] = '\0';
+    bool ok = is_const(name);
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time");
+        return false;
+    }
+    report(1, "Probably constant time");
+    return ok;
 }
 
 /* insert head */
 static bool do_ih(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv, "insert_head");
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -193,10 +268,8 @@ static bool do_ih(int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert head on null queue");
@@ -205,7 +278,7 @@ static bool do_ih(int argc, char *argv[])
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string();
             bool rval = q_insert_head(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
@@ -252,21 +325,9 @@ static bool do_ih(int argc, char *argv[])
 /* insert tail */
 static bool do_it(int argc, char *argv[])
 {
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = is_insert_tail_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv, "insert_tail");
 
-    char randstr_buf[MAX_RANDSTR_LEN];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -282,10 +343,8 @@ static bool do_it(int argc, char *argv[])
         }
     }
 
-    if (!strcmp(inserts, "RAND")) {
+    if (!strcmp(inserts, "RAND"))
         need_rand = true;
-        inserts = randstr_buf;
-    }
 
     if (!l_meta.l)
         report(3, "Warning: Calling insert tail on null queue");
@@ -294,7 +353,7 @@ static bool do_it(int argc, char *argv[])
     if (exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string();
             bool rval = q_insert_tail(l_meta.l, inserts);
             if (rval) {
                 lcnt++;
@@ -328,24 +387,13 @@ static bool do_remove(int option, int argc, char *argv[])
 {
     // option 0 is for remove head; option 1 is for remove tail
 
-    /* FIXME: It is known that both functions is_remove_tail_const() and
-     * is_remove_head_const() can not pass dudect on Arm64. We shall figure
-     * out the exact reasons and resolve later.
+    /* FIXME: It is known that both remove_tail and remove_head can not pass
+     * dudect on Arm64. We shall figure out the exact reasons and resolve
+     * later.
      */
 #if !defined(__aarch64__)
-    if (simulation) {
-        if (argc != 1) {
-            report(1, "%s does not need arguments in simulation mode", argv[0]);
-            return false;
-        }
-        bool ok = option ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1, "ERROR: Probably not constant time");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
-    }
+    if (simulation)
+        return simulate(argc, argv, option ? "remove_tail" : "remove_head");
 #endif
 
     if (argc != 1 && argc != 2) {
@@ -494,6 +542,35 @@ static bool do_rhq(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/*
+ * Values of the queue before dedup, identified by their 64-bit FNV-1a hash
+ * rather than by a copy.  Two different values colliding is unlikely enough
+ * not to be worth telling apart.
+ */
+typedef struct {
+    uint64_t hash; /* 0 for an empty slot */
+    bool dup;      /* Some copy is next to an equal one, to be deleted */
+    uint32_t keep; /* Copies next to no equal one, to be kept */
+    uint32_t kept; /* Copies of those seen after q_delete_dup */
+} dedup_slot_t;
+
+static uint64_t dedup_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (; *s; s++)
+        h = (h ^ (uint8_t) *s) * 0x100000001b3ULL;
+    return h ? h : 1;
+}
+
+/* Slot of hash, or the empty slot for it.  mask + 1 must be a power of 2 */
+static dedup_slot_t *dedup_find(dedup_slot_t *slots, size_t mask, uint64_t hash)
+{
+    size_t i = hash & mask;
+    while (slots[i].hash && slots[i].hash != hash)
+        i = (i + 1) & mask;
+    return &slots[i];
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -501,141 +578,94 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    // establish checking list dup_value
-    struct list_head *dup_value = malloc(sizeof(*dup_value));
-    if (!dup_value) {
+    // table of the values, kept at most half full
+    size_t n = 0;
+    element_t *item;
+    if (l_meta.l)
+        list_for_each_entry (item, l_meta.l, list)
+            n++;
+    size_t mask = 15;
+    while (mask + 1 < 2 * n)
+        mask = 2 * mask + 1;
+    dedup_slot_t *slots = calloc(mask + 1, sizeof(*slots));
+    if (!slots) {
         report(
             1,
             "INTERNAL ERROR.  Could not allocate space for duplicate checking");
         return false;
     }
-    INIT_LIST_HEAD(dup_value);
-    element_t *item = NULL;
-    if (l_meta.l && !list_empty(l_meta.l)) {
-        bool last_dup = false;
 
+    // assume queue has been sorted: only runs of adjacent equal strings
+    // are duplicates, and every other node is to be kept
+    size_t unique = 0;
+    if (l_meta.l) {
+        bool prev_match = false;
         list_for_each_entry (item, l_meta.l, list) {
-            element_t *next_item;
-            if (item->list.next == l_meta.l)
-                break;
-            next_item = list_entry(item->list.next, element_t, list);
-
-            // assume queue has been sorted
-            bool match = !strcmp(item->value, next_item->value);
-            if (match && !last_dup) {
-                int n = strlen(item->value) + 1;
-                char *str = malloc(sizeof(*str) * n);
-                element_t *entry = malloc(sizeof(*entry));
-                if (!str || !entry) {
-                    report(1,
-                           "INTERNAL ERROR.  Could not allocate space for "
-                           "duplicate checking");
-                    free(str);
-
-                    if (list_empty(dup_value)) {
-                        free(dup_value);
-                        return false;
-                    }
-                    element_t *cur, *safe;
-                    list_for_each_entry_safe (cur, safe, dup_value, list) {
-                        free(cur->value);
-                        free(cur);
-                    }
-                    free(dup_value);
-
-                    return false;
-                }
-                strncpy(str, item->value, n);
-                entry->value = str;
-
-                list_add_tail(&entry->list, dup_value);
+            bool next_match =
+                item->list.next != l_meta.l &&
+                !strcmp(item->value,
+                        list_entry(item->list.next, element_t, list)->value);
+            uint64_t hash = dedup_hash(item->value);
+            dedup_slot_t *slot = dedup_find(slots, mask, hash);
+            slot->hash = hash;
+            if (prev_match || next_match) {
+                slot->dup = true;
+            } else {
+                slot->keep++;
+                unique++;
             }
-            last_dup = match;
-            /*
-             * To avoid allocate duplicated string in checking list
-             * dup_value, a variable last_dup is used to record whether
-             * last comparison is matching.
-             * However, cppchek print this:
-             *
-             * - style: Variable 'last_dup' is assigned a value that
-             * - is never used. [unreadVariable]
-             * -    last_dup = match;
-             *
-             * and prevent qtest.c from commiting.
-             * When using valgrind --tool=massif to see the memory usage,
-             * the version using last_dup is better than normal version,
-             * so it is clear that last_dup is not useless.
-             *
-             * Therefore, this function adds a if statement with no
-             * operation at the end of for loop to avoid cppcheck warning.
-             */
-            if (last_dup)  // do nothing
-                continue;
+            prev_match = next_match;
         }
     }
+
     bool ok = true;
+    /* As for free, cautious mode would walk all blocks on every removal */
+    if (n > big_list_size)
+        set_cautious_mode(false);
     if (exception_setup(true))
         ok = q_delete_dup(l_meta.l);
     exception_cancel();
+    set_cautious_mode(true);
 
     if (!ok) {
-        if (list_empty(dup_value)) {
-            free(dup_value);
-            return ok && !error_check();
-        }
-        element_t *cur, *safe;
-        list_for_each_entry_safe (cur, safe, dup_value, list) {
-            free(cur->value);
-            free(cur);
-        }
-        free(dup_value);
-
+        free(slots);
         report(1, "ERROR: Calling delete duplicate on null queue");
         return false;
     }
 
-    item = NULL;
-    // Checking if there are duplicated string remain on queue.
-    // If the string is duplicated at beginning, and remain
-    // on the queue after call of q_dedup, return false.
-    if (l_meta.size && !list_empty(dup_value)) {
-        element_t *next_dup = list_first_entry(dup_value, element_t, list);
+    // every node left must be one to keep, and all of those must remain
+    size_t kept = 0;
+    if (l_meta.l) {
         list_for_each_entry (item, l_meta.l, list) {
-            int cmp = strcmp(item->value, next_dup->value);
-
-            // assume queue has been sorted
-            while (cmp > 0 && next_dup->list.next != dup_value) {
-                next_dup = list_first_entry(&next_dup->list, element_t, list);
-                cmp = strcmp(item->value, next_dup->value);
-            }
-            if (!cmp) {
-                report(1, "ERROR: Duplicate string remain on queue");
+            dedup_slot_t *slot =
+                dedup_find(slots, mask, dedup_hash(item->value));
+            if (slot->kept == slot->keep) {
+                if (slot->dup)
+                    report(1, "ERROR: Duplicate string remain on queue");
+                else
+                    report(1, "ERROR: Unexpected string remain on queue");
                 ok = false;
                 break;
             }
-
-            if (&next_dup->list == dup_value)
-                break;
+            slot->kept++;
+            kept++;
         }
     }
-    show_queue(3);
-
-    if (list_empty(dup_value)) {
-        free(dup_value);
-        return ok && !error_check();
-    }
-    element_t *cur, *safe;
-    list_for_each_entry_safe (cur, safe, dup_value, list) {
-        free(cur->value);
-        free(cur);
+    if (ok && kept != unique) {
+        report(1, "ERROR: Unique string missing from queue");
+        ok = false;
     }
-    free(dup_value);
+    free(slots);
 
+    show_queue(3);
     return ok && !error_check();
 }
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, "reverse");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -657,6 +687,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, "size");
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -754,6 +787,9 @@ bool do_sort(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, "delete_mid");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -774,6 +810,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate(argc, argv, "swap");
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -794,6 +833,126 @@ static bool do_swap(int argc, char *argv[])
     return !error_check();
 }
 
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s takes 1 argument", argv[0]);
+        return false;
+    }
+
+    complexity_t c;
+    bool ok = true;
+    error_check();
+
+    /* Cautious frees would add a walk of all blocks to every operation */
+    set_cautious_mode(false);
+    if (exception_setup(false))
+        ok = complexity_estimate(argv[1], &c);
+    exception_cancel();
+    set_cautious_mode(true);
+
+    if (!ok) {
+        report(1, "Unknown operation '%s'.  Choose one of: %s", argv[1],
+               dut_commands());
+        return false;
+    }
+    if (error_check())
+        return false;
+
+    const char *unit = timer_backend == timer_clock ? "ns" : "cycles";
+    for (int i = 0; i < c.sizes; i++)
+        report(2, "n = %8.0f: %12.0f %s", c.n[i], c.time[i], unit);
+    for (int i = 0; i < number_models; i++)
+        report(2, "%-10s %5.1f%%", complexity_name(i), 100 * c.confidence[i]);
+    report(1, "%s is %s (confidence %.1f%%), time ~= %.1f + %.4g * f(n) %s",
+           argv[1], complexity_name(c.best), 100 * c.confidence[c.best], c.a,
+           c.b, unit);
+    return true;
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    if (argc != 3 && argc != 4) {
+        report(1, "%s takes 2-3 arguments", argv[0]);
+        return false;
+    }
+
+    int n, iterations = 100;
+    if (!get_int(argv[2], &n) || n < 1) {
+        report(1, "Invalid number of elements '%s'", argv[2]);
+        return false;
+    }
+    if (argc == 4 && (!get_int(argv[3], &iterations) || iterations < 1)) {
+        report(1, "Invalid number of iterations '%s'", argv[3]);
+        return false;
+    }
+
+    bench_result_t r[number_bench_data];
+    bool ok = true;
+    error_check();
+
+    /* Cautious frees would add a walk of all blocks to every operation */
+    set_cautious_mode(false);
+    if (exception_setup(false)) {
+        for (int i = 0; ok && i < number_bench_data; i++)
+            ok = bench_run(argv[1], n, i, iterations, &r[i]);
+    }
+    exception_cancel();
+    set_cautious_mode(true);
+
+    if (!ok) {
+        report(1, "Cannot bench '%s' on %d elements.  Operations are: %s",
+               argv[1], n, dut_commands());
+        return false;
+    }
+    if (error_check())
+        return false;
+
+    if (bench_csv)
+        report(1, "op,n,data,iterations,min_ns,median_ns,p99_ns,"
+                  "ns_per_element,allocs_per_op");
+    else
+        report(1, "%-9s %12s %12s %12s %10s %10s", "data", "min ns",
+               "median ns", "p99 ns", "ns/elem", "allocs/op");
+    for (int i = 0; i < number_bench_data; i++) {
+        if (bench_csv)
+            report(1,
+                   "%s,%d,%s,%d,%" PRId64 ",%" PRId64 ",%" PRId64
+                   ",%.3f,%.2f",
+                   argv[1], n, bench_data_name(i), iterations, r[i].min,
+                   r[i].median, r[i].p99, r[i].ns_per_element, r[i].allocs);
+        else
+            report(1, "%-9s %12" PRId64 " %12" PRId64 " %12" PRId64
+                      " %10.2f %10.1f",
+                   bench_data_name(i), r[i].min, r[i].median, r[i].p99,
+                   r[i].ns_per_element, r[i].allocs);
+    }
+    return true;
+}
+
+static bool do_export(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    if (argc == 1) {
+        if (!export_active()) {
+            report(1, "No export in progress");
+            return false;
+        }
+        export_close();
+        return true;
+    }
+
+    if (!export_open(argv[1])) {
+        report(1, "Couldn't open export file '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 static bool is_circular()
 {
     struct list_head *cur = l_meta.l->next;
@@ -874,21 +1033,48 @@ static bool do_show(int argc, char *argv[])
     return show_queue(0);
 }
 
-static void shuffle(struct list_head *head)
+/*
+ * Fisher-Yates shuffle of the queue, in linear time through an array of
+ * its nodes.  Either relinks the nodes in shuffled order, or leaves them in
+ * place and moves the values between them, depending on shuffle_nodes.
+ */
+static bool shuffle(struct list_head *head)
 {
-    int num = q_size(head);
-
-    struct list_head *tmp, *current;
-    for (tmp = head->prev; num > 0; num--) {
-        current = head;
-        for (int i = rand() % num; i >= 0; i--)
-            current = current->next;
-        char *value = list_entry(current, element_t, list)->value;
-        list_entry(current, element_t, list)->value =
-            list_entry(tmp, element_t, list)->value;
-        list_entry(tmp, element_t, list)->value = value;
+    size_t n = 0;
+    struct list_head *li;
+    list_for_each (li, head)
+        n++;
+
+    element_t **nodes = malloc(n * sizeof(element_t *));
+    if (!nodes)
+        return false;
+    size_t i = 0;
+    list_for_each (li, head)
+        nodes[i++] = list_entry(li, element_t, list);
+
+    /* Drawn from the stream seeded by rand_seed, so shuffles repeat */
+    for (i = n - 1; i > 0; i--) {
+        size_t j = random_below(i + 1);
+        if (shuffle_nodes) {
+            element_t *tmp = nodes[i];
+            nodes[i] = nodes[j];
+            nodes[j] = tmp;
+        } else {
+            char *tmp = nodes[i]->value;
+            nodes[i]->value = nodes[j]->value;
+            nodes[j]->value = tmp;
+        }
+    }
+
+    if (shuffle_nodes) {
+        INIT_LIST_HEAD(head);
+        for (i = 0; i < n; i++)
+            list_add_tail(&nodes[i]->list, head);
     }
+    free(nodes);
+    return true;
 }
+
 static bool do_shuffle(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -906,7 +1092,10 @@ static bool do_shuffle(int argc, char *argv[])
         return false;
     }
 
-    shuffle(l_meta.l);
+    if (!shuffle(l_meta.l)) {
+        report(1, "Could not allocate space for shuffling");
+        return false;
+    }
     show_queue(3);
     return true;
 }
@@ -920,6 +1109,11 @@ static bool do_web(int argc, char *argv[])
     return true;
 }
 
+static void fault_setter(int oldval)
+{
+    fault_reset();
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "                | Create new queue");
@@ -955,10 +1149,69 @@ static void console_init()
                 "                | Swap every two adjacent nodes in queue");
     ADD_COMMAND(shuffle, "                | Shuffle the list");
     ADD_COMMAND(web, "                | Open web server");
+    ADD_COMMAND(export,
+                " [file]         | Write raw simulation measurements to file. "
+                "Stop writing if no file is given");
+    ADD_COMMAND(bench,
+                " op n [iter]    | Time iter (default: 100) runs of queue "
+                "operation op on n elements of generated data");
+    ADD_COMMAND(complexity,
+                " op             | Estimate time complexity of queue "
+                "operation op, such as sort or dm");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("malloc_seed", &fail_seed,
+              "Seed for malloc failures (resets allocation count)",
+              fault_setter);
+    add_param("malloc_every", &fail_every, "Fail every Nth malloc (0 = off)",
+              NULL);
+    add_param("malloc_first", &fail_first,
+              "First malloc number of failing range (0 = off)", NULL);
+    add_param("malloc_last", &fail_last,
+              "Last malloc number of failing range (0 = malloc_first)", NULL);
+    add_param("malloc_size", &fail_min_size,
+              "Only fail mallocs larger than this many bytes", NULL);
+    add_param("timeout", &time_limit,
+              "Time limit of each queue operation in ms (0 = off)", NULL);
+    add_param("compact", &compact_mode,
+              "Keep malloc metadata in side table instead of block headers",
+              NULL);
+    add_param("dudect_threads", &dudect_threads,
+              "Measuring threads in simulation mode (0 = one per CPU)", NULL);
+    add_param("dudect_crop", &dudect_crop,
+              "Add percentile-cropped and second order tests to simulation",
+              NULL);
+    add_param("dudect_timer", &dudect_timer,
+              "Simulation timer: 0 rdtsc, 1 fenced, 2 perf, 3 clock_gettime",
+              NULL);
+    add_param("dudect_sequential", &dudect_sequential,
+              "Stop simulation early once the verdict is clear", NULL);
+    add_param("dudect_cpu", &dudect_cpu,
+              "CPU to pin simulation to (-1 = no pinning)", NULL);
+    add_param("dudect_warmup", &dudect_warmup,
+              "Longest busy-loop warm-up before simulation in ms (0 = off)",
+              NULL);
+    add_param("dudect_cache", &dudect_cache,
+              "Cache state before each measurement: 0 as is, 1 warm, "
+              "2 flushed",
+              NULL);
+    add_param("rand_seed", &rand_seed,
+              "Seed of random strings, shuffles and scripts (0 = new each run)",
+              rand_seed_setter);
+    add_param("rand_min_len", &rand_min_len, "Shortest random string",
+              rand_min_len_setter);
+    add_param("rand_max_len", &rand_max_len, "Longest random string",
+              rand_max_len_setter);
+    add_param("rand_alphabet", &rand_alphabet,
+              "Characters random strings draw from (26 = a-z, 62 = a-zA-Z0-9)",
+              rand_alphabet_setter);
+    add_param("shuffle_nodes", &shuffle_nodes,
+              "Shuffle by relinking nodes rather than swapping values", NULL);
+    add_param("bench_csv", &bench_csv, "Print bench results as CSV", NULL);
+    add_param("complexity_max", &complexity_max,
+              "Largest queue size measured by complexity", NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("listsort", &listsort, "Use list_sort or not", NULL);
@@ -984,6 +1237,7 @@ static void sigalrmhandler(int sig)
 static void queue_init()
 {
     fail_count = 0;
+    fault_reset();
     l_meta.l = NULL;
     signal(SIGSEGV, sigsegvhandler);
     signal(SIGALRM, sigalrmhandler);
@@ -991,6 +1245,8 @@ static void queue_init()
 
 static bool queue_quit(int argc, char *argv[])
 {
+    export_close();
+
     report(3, "Freeing queue");
     if (lcnt > big_list_size)
         set_cautious_mode(false);
@@ -1012,11 +1268,12 @@ static bool queue_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-c CFILE]\n", cmd);
     printf("\t-h         Print this information\n");
-    printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-f IFILE   Read commands from IFILE, text or compiled\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-c CFILE   Compile IFILE into CFILE instead of running it\n");
     exit(0);
 }
 
@@ -1065,10 +1322,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char cbuf[BUFSIZE];
+    char *compile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:c:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1093,6 +1352,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'c':
+            strncpy(cbuf, optarg, BUFSIZE);
+            cbuf[BUFSIZE - 1] = '\0';
+            compile_name = cbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1100,7 +1364,6 @@ int main(int argc, char *argv[])
         }
     }
 
-    srand((unsigned int) (time(NULL)));
     queue_init();
     init_cmd();
     console_init();
@@ -1115,6 +1378,14 @@ int main(int argc, char *argv[])
     }
 
     set_verblevel(level);
+    if (compile_name) {
+        if (!infile_name) {
+            fprintf(stderr, "Compiling requires a trace given by -f\n");
+            exit(EXIT_FAILURE);
+        }
+        return compile_trace(infile_name, compile_name) ? 0 : 1;
+    }
+
     if (level > 1) {
         set_echo(true);
     }
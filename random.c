@@ -1,11 +1,54 @@
 #include "random.h"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+/*
+ * Userspace generator: ChaCha20 keystream, seeded once per thread from the
+ * kernel.  Each refill of the pool computes pool_blocks blocks and rekeys
+ * with the first key_size bytes of them, so that earlier output cannot be
+ * recovered from the state ("fast key erasure", as OpenBSD's arc4random).
+ */
+
+/* Keystream blocks computed per refill */
+#define pool_blocks 16
+#define block_size 64
+#define key_size 32
+
+typedef struct {
+    uint32_t key[key_size / 4];
+    uint8_t pool[pool_blocks * block_size];
+    size_t left;         /* Unused bytes at the end of pool */
+    unsigned generation; /* Value of fork_generation when seeded */
+    bool seeded;
+} rng_t;
+
+static __thread rng_t rng;
+
+/* Bumped in the child after fork, so that it does not repeat its parent */
+static volatile unsigned fork_generation = 0;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void forked(void)
+{
+    fork_generation++;
+}
+
+static void register_atfork(void)
+{
+    pthread_atfork(NULL, NULL, forked);
+}
 
 /* shameless stolen from ebacs */
-void randombytes(uint8_t *x, size_t how_much)
+static void urandom(uint8_t *x, size_t how_much)
 {
     ssize_t i;
     static int fd = -1;
@@ -37,3 +80,184 @@ void randombytes(uint8_t *x, size_t how_much)
         xlen -= i;
     }
 }
+
+/* Fill x from the kernel, falling back to /dev/urandom without getrandom */
+static void kernel_random(uint8_t *x, size_t xlen)
+{
+#ifdef __linux__
+    while (xlen > 0) {
+        ssize_t got = getrandom(x, xlen, 0);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        x += got;
+        xlen -= got;
+    }
+#endif
+    if (xlen > 0)
+        urandom(x, xlen);
+}
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+/* One ChaCha20 block of keystream for key, block counter and a zero nonce */
+static void chacha20_block(uint8_t *out, const uint32_t *key, uint64_t counter)
+{
+    uint32_t in[16] = {
+        0x61707865,
+        0x3320646e,
+        0x79622d32,
+        0x6b206574,
+        key[0],
+        key[1],
+        key[2],
+        key[3],
+        key[4],
+        key[5],
+        key[6],
+        key[7],
+        (uint32_t) counter,
+        (uint32_t) (counter >> 32),
+        0,
+        0,
+    };
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static void refill(void)
+{
+    pthread_once(&atfork_once, register_atfork);
+    if (!rng.seeded || rng.generation != fork_generation) {
+        kernel_random((uint8_t *) rng.key, key_size);
+        rng.generation = fork_generation;
+        rng.seeded = true;
+    }
+
+    for (uint64_t i = 0; i < pool_blocks; i++)
+        chacha20_block(rng.pool + i * block_size, rng.key, i);
+
+    /* Rekey from the head of the pool, and never hand those bytes out */
+    memcpy(rng.key, rng.pool, key_size);
+    memset(rng.pool, 0, key_size);
+    rng.left = sizeof(rng.pool) - key_size;
+}
+
+void randombytes(uint8_t *x, size_t xlen)
+{
+    /* Output of a pool filled before fork would repeat in the child */
+    if (rng.seeded && rng.generation != fork_generation)
+        rng.left = 0;
+
+    while (xlen > 0) {
+        if (!rng.left)
+            refill();
+
+        size_t n = xlen < rng.left ? xlen : rng.left;
+        uint8_t *from = rng.pool + sizeof(rng.pool) - rng.left;
+        memcpy(x, from, n);
+        /* Erase bytes once handed out */
+        memset(from, 0, n);
+        rng.left -= n;
+        x += n;
+        xlen -= n;
+    }
+}
+
+void xoshiro_seed(xoshiro_t *g, uint64_t seed)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        g->s[i] = z ^ (z >> 31);
+    }
+}
+
+static xoshiro_t shared;
+static bool shared_seeded = false;
+
+static inline xoshiro_t *shared_stream(void)
+{
+    if (!shared_seeded)
+        random_seed(0);
+    return &shared;
+}
+
+void random_seed(uint64_t seed)
+{
+    if (!seed)
+        randombytes((uint8_t *) &seed, sizeof(seed));
+    xoshiro_seed(&shared, seed);
+    shared_seeded = true;
+}
+
+uint32_t random_below(uint32_t n)
+{
+    return xoshiro_below(shared_stream(), n);
+}
+
+void randstr_fill(char *buf,
+                  char **strs,
+                  size_t count,
+                  size_t min_len,
+                  size_t max_len,
+                  const char *alphabet,
+                  size_t alphabet_size)
+{
+    xoshiro_t *g = shared_stream();
+
+    /*
+     * Every 16 random bits give one character, or the length, mapped to
+     * their range by a multiply and shift rather than a division.
+     */
+    uint64_t span = max_len - min_len + 1;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t w = xoshiro_next(g);
+        size_t len = min_len + (((w >> 48) * span) >> 16);
+        int fields = 3;
+        for (size_t k = 0; k < len; k++, w >>= 16, fields--) {
+            if (!fields) {
+                w = xoshiro_next(g);
+                fields = 4;
+            }
+            buf[k] = alphabet[((w & 0xffff) * alphabet_size) >> 16];
+        }
+        buf[len] = '\0';
+        strs[i] = buf;
+        buf += len + 1;
+    }
+}
@@ -13,4 +13,65 @@ static inline uint8_t randombit(void)
     return ret & 1;
 }
 
+/*
+ * Seedable generator: xoshiro256**, see https://prng.di.unimi.it/, with
+ * its seed expanded by splitmix64.  Unlike randombytes(), it is not meant
+ * for secrets, but it is fast and can be seeded to repeat its output.
+ */
+typedef struct {
+    uint64_t s[4];
+} xoshiro_t;
+
+/* Seed g, so that even small or similar seeds give unrelated streams */
+void xoshiro_seed(xoshiro_t *g, uint64_t seed);
+
+#define XOSHIRO_ROTL(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+static inline uint64_t xoshiro_next(xoshiro_t *g)
+{
+    uint64_t *st = g->s;
+    const uint64_t result = XOSHIRO_ROTL(st[1] * 5, 7) * 9;
+    const uint64_t t = st[1] << 17;
+
+    st[2] ^= st[0];
+    st[3] ^= st[1];
+    st[1] ^= st[2];
+    st[0] ^= st[3];
+    st[2] ^= t;
+    st[3] = XOSHIRO_ROTL(st[3], 45);
+
+    return result;
+}
+
+/* Uniform in [0, n), mapping 32 random bits by a multiply and shift */
+static inline uint32_t xoshiro_below(xoshiro_t *g, uint32_t n)
+{
+    return ((xoshiro_next(g) >> 32) * n) >> 32;
+}
+
+/*
+ * Shared stream of random strings, shuffles and scripts, seeded once from
+ * randombytes() unless random_seed() is called first.  Not thread safe.
+ */
+
+/* Seed the shared stream, or take a seed from randombytes() if 0 */
+void random_seed(uint64_t seed);
+
+/* Uniform in [0, n) from the shared stream */
+uint32_t random_below(uint32_t n);
+
+/*
+ * Write count null-terminated random strings one after another into buf,
+ * which must hold count * (max_len + 1) bytes, and a pointer to each into
+ * strs.  Lengths are uniform in [min_len, max_len], and characters uniform
+ * among the first alphabet_size of alphabet.
+ */
+void randstr_fill(char *buf,
+                  char **strs,
+                  size_t count,
+                  size_t min_len,
+                  size_t max_len,
+                  const char *alphabet,
+                  size_t alphabet_size);
+
 #endif
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Offline analysis of raw simulation measurements.
+
+Reads a file written by the qtest command "export FILE", and prints, for
+every simulation in it, the Welch's t-test on the execution times and a
+histogram of each input class.
+"""
+
+import argparse
+import math
+import struct
+import sys
+
+MAGIC = b"dudect\0\2"
+HEADER = struct.Struct("=8sII")
+RECORD = struct.Struct("=qIIIBBBB")
+
+# Operations in order of dut_ops in dudect/constant.c
+MODES = ["insert_head", "insert_tail", "remove_head", "remove_tail", "size",
+         "delete_mid", "swap", "reverse", "delete_dup", "sort", "free"]
+# Timer backends, as timer_backend in dudect/cpucycles.h
+TIMERS = ["rdtsc cycles", "fenced cycles", "perf cycles", "ns"]
+
+
+def read(path):
+    """Yield (ticks, test, batch, cpu, mode, class, timer) of each
+    measurement."""
+    with open(path, "rb") as f:
+        magic, size, _ = HEADER.unpack(f.read(HEADER.size))
+        if magic != MAGIC or size != RECORD.size:
+            sys.exit("%s: not a raw measurement export" % path)
+        while True:
+            data = f.read(RECORD.size * 4096)
+            if not data:
+                break
+            for ticks, test, batch, cpu, mode, cls, timer, _ in \
+                    RECORD.iter_unpack(data[:len(data) // RECORD.size *
+                                            RECORD.size]):
+                yield ticks, test, batch, cpu, mode, cls, timer
+
+
+def welch(samples):
+    """Welch's t statistic of two lists of samples, as dudect/ttest.c."""
+    n = [len(s) for s in samples]
+    if min(n) < 2:
+        return float("nan")
+    mean = [sum(s) / len(s) for s in samples]
+    var = [sum((x - m) ** 2 for x in s) / (len(s) - 1)
+           for s, m in zip(samples, mean)]
+    return (mean[0] - mean[1]) / math.sqrt(var[0] / n[0] + var[1] / n[1])
+
+
+def percentile(sorted_samples, p):
+    return sorted_samples[min(len(sorted_samples) - 1,
+                              int(p * len(sorted_samples)))]
+
+
+def histogram(samples, lo, hi, bins, width=50):
+    counts = [0] * bins
+    step = (hi - lo) / bins or 1
+    for x in samples:
+        if lo <= x <= hi:
+            counts[min(bins - 1, int((x - lo) / step))] += 1
+    top = max(counts) or 1
+    for i, c in enumerate(counts):
+        print("  %10.0f %7d %s" % (lo + i * step, c, "#" * (c * width // top)))
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("file", help="file written by qtest command export")
+    parser.add_argument("-b", "--bins", type=int, default=20,
+                        help="histogram bins (default: 20)")
+    parser.add_argument("-c", "--crop", type=float, default=1.0,
+                        help="keep only the fastest fraction of "
+                        "measurements (default: 1.0)")
+    parser.add_argument("--cpu", type=int,
+                        help="keep only measurements from this CPU")
+    parser.add_argument("-q", "--quiet", action="store_true",
+                        help="print only the t-test of each simulation")
+    args = parser.parse_args(argv)
+
+    tests = {}
+    for ticks, test, batch, cpu, mode, cls, timer in read(args.file):
+        # Dropped measurements, as in update_statistics()
+        if ticks <= 0 or (args.cpu is not None and cpu != args.cpu):
+            continue
+        # Each simulation picks its backend when it starts
+        key = (test, mode, timer)
+        tests.setdefault(key, ([], [], set()))
+        tests[key][cls].append(ticks)
+        tests[key][2].add(batch)
+
+    for (test, mode, timer), (zero, one, batches) in sorted(tests.items()):
+        samples = [sorted(zero), sorted(one)]
+        if args.crop < 1:
+            everything = sorted(samples[0] + samples[1])
+            limit = percentile(everything, args.crop)
+            samples = [[x for x in s if x < limit] for s in samples]
+
+        name = MODES[mode] if mode < len(MODES) else str(mode)
+        unit = TIMERS[timer] if timer < len(TIMERS) else "ticks"
+        print("test %d %s: %d batches, %d + %d measurements, t = %+.2f" %
+              (test, name, len(batches), len(samples[0]), len(samples[1]),
+               welch(samples)))
+        if args.quiet or not samples[0] or not samples[1]:
+            continue
+
+        # Shared range, clipped at the 99th percentile to keep tails legible
+        everything = sorted(samples[0] + samples[1])
+        lo, hi = everything[0], percentile(everything, 0.99)
+        for cls in (0, 1):
+            s = samples[cls]
+            print(" class %d: mean %.1f, median %d %s" %
+                  (cls, sum(s) / len(s), percentile(s, 0.5), unit))
+            histogram(s, lo, hi, args.bins)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])